@@ -3,7 +3,9 @@
 
 // DCMQI includes
 #undef HAVE_SSTREAM // Avoid redefinition warning
+#include "dcmqi/DicomDirectoryScanner.h"
 #include "dcmqi/ParaMapConverter.h"
+#include "dcmqi/WorkerPool.h"
 #include "dcmqi/internal/VersionConfigure.h"
 
 
@@ -21,6 +23,13 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
+  unsigned numberOfThreads = 0;
+  try {
+    numberOfThreads = dcmqi::WorkerPool::getNumberOfThreads(threads);
+  } catch(int) {
+    return EXIT_FAILURE;
+  }
+
   FloatReaderType::Pointer reader = FloatReaderType::New();
   reader->SetFileName(inputFileName.c_str());
   reader->Update();
@@ -29,11 +38,20 @@ int main(int argc, char *argv[])
   if(dicomDirectory.size()){
     if (!helper::pathExists(dicomDirectory))
       return EXIT_FAILURE;
-    vector<string> dicomFileList = helper::getFileListRecursively(dicomDirectory.c_str());
+    dcmqi::DicomDirectoryScanner scanner;
+    scanner.scan(dicomDirectory, dicomIndexFileName, numberOfThreads);
+    vector<string> dicomFileList;
+    if(!scanner.getMatchingFiles(parametricMapImage, dicomFileList))
+      return EXIT_FAILURE;
     dicomImageFileList.insert(dicomImageFileList.end(), dicomFileList.begin(), dicomFileList.end());
   }
 
-  vector<DcmDataset*> dcmDatasets = helper::loadDatasets(dicomImageFileList);
+  vector<DcmDataset*> dcmDatasets;
+  try {
+    dcmDatasets = helper::loadDatasets(dicomImageFileList, numberOfThreads);
+  } catch(int) {
+    return EXIT_FAILURE;
+  }
 
   if(dcmDatasets.empty()){
     cerr << "ERROR: no DICOM could be loaded from the specified list/directory" << endl;
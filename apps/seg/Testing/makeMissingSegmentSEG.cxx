@@ -0,0 +1,53 @@
+// Changes the ReferencedSegmentNumber of every frame of a segmentation, to test the
+//  decoding of frames that reference a segment missing from SegmentSequence.
+//
+// Usage: makeMissingSegmentSEG inputSEG outputSEG segmentNumber
+
+// DCMTK includes
+#include <dcmtk/config/osconfig.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcfilefo.h>
+#include <dcmtk/dcmdata/dcsequen.h>
+
+// STD includes
+#include <cstdlib>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if(argc != 4){
+    cerr << "Usage: " << argv[0] << " inputSEG outputSEG segmentNumber" << endl;
+    return EXIT_FAILURE;
+  }
+  const Uint16 segmentNumber = Uint16(atoi(argv[3]));
+
+  DcmFileFormat fileFormat;
+  if(fileFormat.loadFile(argv[1]).bad()){
+    cerr << "ERROR: Failed to read " << argv[1] << endl;
+    return EXIT_FAILURE;
+  }
+  DcmDataset *dataset = fileFormat.getDataset();
+
+  DcmSequenceOfItems *perFrameFGs = NULL;
+  if(dataset->findAndGetSequence(DCM_PerFrameFunctionalGroupsSequence, perFrameFGs).bad() || !perFrameFGs){
+    cerr << "ERROR: " << argv[1] << " has no PerFrameFunctionalGroupsSequence" << endl;
+    return EXIT_FAILURE;
+  }
+
+  for(unsigned long itemId=0;itemId<perFrameFGs->card();itemId++){
+    DcmItem *segmentIdentification = NULL;
+    if(perFrameFGs->getItem(itemId)->findAndGetSequenceItem(DCM_SegmentIdentificationSequence,
+                                                            segmentIdentification).bad() ||
+       segmentIdentification->putAndInsertUint16(DCM_ReferencedSegmentNumber, segmentNumber).bad()){
+      cerr << "ERROR: Failed to set ReferencedSegmentNumber of frame " << itemId+1 << endl;
+      return EXIT_FAILURE;
+    }
+  }
+
+  if(fileFormat.saveFile(argv[2], EXS_LittleEndianExplicit).bad()){
+    cerr << "ERROR: Failed to write " << argv[2] << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,54 @@
+// Moves PlaneOrientationSequence of a segmentation from the shared functional groups
+//  into the functional groups of every frame, to test the decoding of objects that
+//  store the orientation per frame.
+//
+// Usage: makePerFrameOrientationSEG inputSEG outputSEG
+
+// DCMTK includes
+#include <dcmtk/config/osconfig.h>
+#include <dcmtk/dcmdata/dcdeftag.h>
+#include <dcmtk/dcmdata/dcfilefo.h>
+#include <dcmtk/dcmdata/dcsequen.h>
+
+// STD includes
+#include <cstdlib>
+#include <iostream>
+
+using namespace std;
+
+int main(int argc, char *argv[]) {
+  if(argc != 3){
+    cerr << "Usage: " << argv[0] << " inputSEG outputSEG" << endl;
+    return EXIT_FAILURE;
+  }
+
+  DcmFileFormat fileFormat;
+  if(fileFormat.loadFile(argv[1]).bad()){
+    cerr << "ERROR: Failed to read " << argv[1] << endl;
+    return EXIT_FAILURE;
+  }
+  DcmDataset *dataset = fileFormat.getDataset();
+
+  DcmItem *sharedFGs = NULL;
+  DcmSequenceOfItems *perFrameFGs = NULL, *planeOrientation = NULL;
+  if(dataset->findAndGetSequenceItem(DCM_SharedFunctionalGroupsSequence, sharedFGs).bad() ||
+     dataset->findAndGetSequence(DCM_PerFrameFunctionalGroupsSequence, perFrameFGs).bad() || !perFrameFGs ||
+     sharedFGs->findAndGetSequence(DCM_PlaneOrientationSequence, planeOrientation).bad() || !planeOrientation){
+    cerr << "ERROR: " << argv[1] << " has no shared PlaneOrientationSequence" << endl;
+    return EXIT_FAILURE;
+  }
+
+  for(unsigned long itemId=0;itemId<perFrameFGs->card();itemId++){
+    if(perFrameFGs->getItem(itemId)->insert(new DcmSequenceOfItems(*planeOrientation)).bad()){
+      cerr << "ERROR: Failed to add PlaneOrientationSequence to frame " << itemId+1 << endl;
+      return EXIT_FAILURE;
+    }
+  }
+  sharedFGs->findAndDeleteElement(DCM_PlaneOrientationSequence);
+
+  if(fileFormat.saveFile(argv[2], EXS_LittleEndianExplicit).bad()){
+    cerr << "ERROR: Failed to write " << argv[2] << endl;
+    return EXIT_FAILURE;
+  }
+  return EXIT_SUCCESS;
+}
@@ -3,11 +3,27 @@
 
 // DCMQI includes
 #undef HAVE_SSTREAM // Avoid redefinition warning
+#include "dcmqi/DicomDirectoryScanner.h"
 #include "dcmqi/ImageSEGConverter.h"
+#include "dcmqi/WorkerPool.h"
 #include "dcmqi/internal/VersionConfigure.h"
 
+// ITK includes
+#include <itkImageIOFactory.h>
+
 typedef dcmqi::Helper helper;
 
+static bool isUInt8Image(const string &fileName)
+{
+  itk::ImageIOBase::Pointer imageIO =
+      itk::ImageIOFactory::CreateImageIO(fileName.c_str(), itk::ImageIOFactory::ReadMode);
+  if(imageIO.IsNull())
+    return false;
+  imageIO->SetFileName(fileName);
+  imageIO->ReadImageInformation();
+  return imageIO->GetComponentType() == itk::ImageIOBase::UCHAR && imageIO->GetNumberOfComponents() == 1;
+}
+
 int main(int argc, char *argv[])
 {
   std::cout << dcmqi_INFO << std::endl;
@@ -25,30 +41,16 @@ int main(int argc, char *argv[])
     return EXIT_FAILURE;
   }
 
-  vector<ShortImageType::Pointer> segmentations;
-
-  for(size_t segFileNumber=0; segFileNumber<segImageFiles.size(); segFileNumber++){
-    ShortReaderType::Pointer reader = ShortReaderType::New();
-    reader->SetFileName(segImageFiles[segFileNumber]);
-    reader->Update();
-    ShortImageType::Pointer labelImage = reader->GetOutput();
-    segmentations.push_back(labelImage);
-  }
-
-  if(dicomDirectory.size()){
-    if (!helper::pathExists(dicomDirectory))
-      return EXIT_FAILURE;
-    vector<string> dicomFileList = helper::getFileListRecursively(dicomDirectory.c_str());
-    dicomImageFiles.insert(dicomImageFiles.end(), dicomFileList.begin(), dicomFileList.end());
-  }
-
-  if(!helper::pathsExist(dicomImageFiles))
+  const bool fractional = segmentationType != "BINARY";
+  if(fractional && (maximumFractionalValue < 1 || maximumFractionalValue > 255)){
+    cerr << "Error: Maximum fractional value should be in the range 1..255!" << endl;
     return EXIT_FAILURE;
+  }
 
-  vector<DcmDataset*> dcmDatasets = helper::loadDatasets(dicomImageFiles);
-
-  if(dcmDatasets.empty()){
-    cerr << "Error: no DICOM could be loaded from the specified list/directory" << endl;
+  unsigned numberOfThreads = 0;
+  try {
+    numberOfThreads = dcmqi::WorkerPool::getNumberOfThreads(threads);
+  } catch(int) {
     return EXIT_FAILURE;
   }
 
@@ -64,11 +66,11 @@ int main(int argc, char *argv[])
       cerr << "Number of files in segmentAttributesFileMapping should match the number of entries in segmentAttributes!" << endl;
       return EXIT_FAILURE;
     }
-    // otherwise, re-order the entries in the segmentAtrributes list to match the order of files in segmentAttributesFileMapping
-    Json::Value reorderedSegmentAttributes;
+    // otherwise, re-order the input files to match the order of the entries in the segmentAtrributes list,
+    //  which follows the order of files in segmentAttributesFileMapping
     vector<int> fileOrder(segImageFiles.size());
     fill(fileOrder.begin(), fileOrder.end(), -1);
-    vector<ShortImageType::Pointer> segmentationsReordered(segImageFiles.size());
+    vector<string> segImageFilesReordered(segImageFiles.size());
     for(size_t filePosition=0;filePosition<segImageFiles.size();filePosition++){
       for(size_t mappingPosition=0;mappingPosition<segImageFiles.size();mappingPosition++){
         string mappingItem = metaRoot["segmentAttributesFileMapping"][static_cast<int>(mappingPosition)].asCString();
@@ -86,13 +88,89 @@ int main(int argc, char *argv[])
     cout << "Order of input ITK images updated as shown below based on the segmentAttributesFileMapping attribute:" << endl;
     for(size_t i=0;i<segImageFiles.size();i++){
       cout << " image " << i << " moved to position " << fileOrder[i] << endl;
-      segmentationsReordered[fileOrder[i]] = segmentations[i];
+      segImageFilesReordered[fileOrder[i]] = segImageFiles[i];
+    }
+    segImageFiles = segImageFilesReordered;
+  }
+
+  vector<ShortImageType::Pointer> segmentations;
+  vector<ProbabilityImageType::Pointer> probabilityMaps;
+  vector<FractionalImageType::Pointer> fractionalMaps;
+
+  // 8-bit images of a fractional segmentation hold the stored values, any other
+  //  type is read as probabilities
+  bool fractionalValueInput = fractional;
+  for(size_t segFileNumber=0; fractional && segFileNumber<segImageFiles.size(); segFileNumber++)
+    fractionalValueInput = fractionalValueInput && isUInt8Image(segImageFiles[segFileNumber]);
+
+  for(size_t segFileNumber=0; segFileNumber<segImageFiles.size(); segFileNumber++){
+    if(!fractional){
+      ShortReaderType::Pointer reader = ShortReaderType::New();
+      reader->SetFileName(segImageFiles[segFileNumber]);
+      reader->Update();
+      segmentations.push_back(reader->GetOutput());
+    } else if(fractionalValueInput){
+      FractionalReaderType::Pointer reader = FractionalReaderType::New();
+      reader->SetFileName(segImageFiles[segFileNumber]);
+      reader->Update();
+      fractionalMaps.push_back(reader->GetOutput());
+    } else {
+      ProbabilityReaderType::Pointer reader = ProbabilityReaderType::New();
+      reader->SetFileName(segImageFiles[segFileNumber]);
+      reader->Update();
+      probabilityMaps.push_back(reader->GetOutput());
     }
-    segmentations = segmentationsReordered;
+  }
+  const itk::ImageBase<3> *geometryImage = NULL;
+  if(!fractional)
+    geometryImage = segmentations[0];
+  else if(fractionalValueInput)
+    geometryImage = fractionalMaps[0];
+  else
+    geometryImage = probabilityMaps[0];
+
+  if(dicomDirectory.size()){
+    if (!helper::pathExists(dicomDirectory))
+      return EXIT_FAILURE;
+    dcmqi::DicomDirectoryScanner scanner;
+    scanner.scan(dicomDirectory, dicomIndexFileName, numberOfThreads);
+    vector<string> dicomFileList;
+    if(!scanner.getMatchingFiles(geometryImage, dicomFileList))
+      return EXIT_FAILURE;
+    dicomImageFiles.insert(dicomImageFiles.end(), dicomFileList.begin(), dicomFileList.end());
+  }
+
+  if(!helper::pathsExist(dicomImageFiles))
+    return EXIT_FAILURE;
+
+  vector<DcmDataset*> dcmDatasets;
+  try {
+    dcmDatasets = helper::loadDatasets(dicomImageFiles, numberOfThreads);
+  } catch(int) {
+    return EXIT_FAILURE;
+  }
+
+  if(dcmDatasets.empty()){
+    cerr << "Error: no DICOM could be loaded from the specified list/directory" << endl;
+    return EXIT_FAILURE;
   }
 
   try {
-    DcmDataset* result = dcmqi::ImageSEGConverter::itkimage2dcmSegmentation(dcmDatasets, segmentations, metadata, skipEmptySlices);
+    DcmDataset* result = NULL;
+    if(!fractional){
+      result = dcmqi::ImageSEGConverter::itkimage2dcmSegmentation(dcmDatasets, segmentations, metadata,
+                                                                  skipEmptySlices, skipEmptyFrames,
+                                                                  numberOfThreads);
+    } else {
+      const DcmSegTypes::E_SegmentationFractionalType fractionalType =
+          segmentationType == "OCCUPANCY" ? DcmSegTypes::SFT_OCCUPANCY : DcmSegTypes::SFT_PROBABILITY;
+      if(fractionalValueInput)
+        result = dcmqi::ImageSEGConverter::itkimage2dcmFractionalSegmentation(dcmDatasets, fractionalMaps, metadata,
+            fractionalType, Uint8(maximumFractionalValue), skipEmptySlices, skipEmptyFrames, numberOfThreads);
+      else
+        result = dcmqi::ImageSEGConverter::itkimage2dcmFractionalSegmentation(dcmDatasets, probabilityMaps, metadata,
+            fractionalType, Uint8(maximumFractionalValue), skipEmptySlices, skipEmptyFrames, numberOfThreads);
+    }
 
     if (result == NULL){
       std::cerr << "ERROR: Conversion failed." << std::endl;
@@ -4,12 +4,144 @@
 // DCMQI includes
 #undef HAVE_SSTREAM // Avoid redefinition warning
 #include "dcmqi/ImageSEGConverter.h"
+#include "dcmqi/WorkerPool.h"
 #include "dcmqi/internal/VersionConfigure.h"
 
+// ITK includes
+#include <itkImageIOFactory.h>
 
 typedef dcmqi::Helper helper;
 
 
+// Writes the segments as they are decoded. The images are collected in batches of
+//  up to numberOfWriters images, which are compressed and written concurrently;
+//  decoding waits while a batch is written, so that no more than numberOfWriters
+//  segment images need to be kept in memory at a time. Writing does not overlap
+//  with decoding, only the images of a batch are written in parallel.
+class SegmentImageWriter : public dcmqi::SegmentImageVisitor, public dcmqi::FractionalSegmentImageVisitor {
+public:
+  SegmentImageWriter(const string &outputDirName, const string &outputPrefix, const string &fileExtension,
+                     unsigned numberOfWriters)
+      : outputDirName(outputDirName), outputPrefix(outputPrefix), fileExtension(fileExtension),
+        numberOfWriters(numberOfWriters) {}
+
+  void visit(unsigned segmentNumber, ShortImageType::Pointer segmentImage) {
+    add(segmentNumber, segmentImage.GetPointer(), &write<ShortImageType>);
+  }
+
+  void visit(unsigned segmentNumber, ProbabilityImageType::Pointer probabilityImage) {
+    add(segmentNumber, probabilityImage.GetPointer(), &write<ProbabilityImageType>);
+  }
+
+  void visit(unsigned segmentNumber, FractionalImageType::Pointer fractionalImage) {
+    add(segmentNumber, fractionalImage.GetPointer(), &write<FractionalImageType>);
+  }
+
+  // Writes the images that are still pending. All of the images of the batch are
+  //  written even if some of them fail; returns false if writing any of the images
+  //  failed, the error is reported for each file that could not be written.
+  bool flush() {
+    // The image IOs are created before the threads are started: the IO factories
+    //  are registered on first use, which is not thread-safe
+    vector<string> ioErrors(pendingImages.size());
+    for(size_t i=0;i<pendingImages.size();i++){
+      pendingImages[i].imageIO = itk::ImageIOFactory::CreateImageIO(pendingImages[i].fileName.c_str(),
+                                                                    itk::ImageIOFactory::WriteMode);
+      if(pendingImages[i].imageIO.IsNull())
+        ioErrors[i] = "no ImageIO available for the file type";
+    }
+
+    WriteTask writeTask(pendingImages);
+    bool written = dcmqi::WorkerPool::run(writeTask, pendingImages.size(), numberOfWriters);
+    if(!written)
+      cerr << "ERROR: Writing of the segment images was interrupted" << endl;
+
+    for(size_t i=0;i<pendingImages.size();i++){
+      const string &error = ioErrors[i].empty() ? writeTask.errors[i] : ioErrors[i];
+      if(error.empty())
+        continue;
+      cerr << "ERROR: Failed to write " << pendingImages[i].fileName << ": " << error << endl;
+      written = false;
+    }
+    pendingImages.clear();
+    return written;
+  }
+
+private:
+  typedef void (*WriteFunction)(const string &fileName, itk::ImageIOBase *imageIO, itk::ImageBase<3> *image);
+
+  struct PendingImage {
+    string fileName;
+    itk::ImageIOBase::Pointer imageIO;
+    itk::ImageBase<3>::Pointer image;
+    WriteFunction write;
+  };
+
+  // Writes one image of the batch per item. Failures are recorded per item instead
+  //  of being thrown, so that the rest of the batch is still written.
+  class WriteTask : public dcmqi::WorkerTask {
+  public:
+    WriteTask(const vector<PendingImage> &pendingImages)
+        : errors(pendingImages.size()), pendingImages(pendingImages) {}
+
+    void process(size_t itemId) {
+      const PendingImage &pendingImage = pendingImages[itemId];
+      if(pendingImage.imageIO.IsNull())
+        return;
+      try {
+        pendingImage.write(pendingImage.fileName, pendingImage.imageIO, pendingImage.image);
+      } catch(itk::ExceptionObject &e) {
+        errors[itemId] = e.GetDescription();
+      } catch(std::exception &e) {
+        errors[itemId] = e.what();
+      } catch(...) {
+        errors[itemId] = "unknown error";
+      }
+    }
+
+    // error description for each item, empty if the image was written
+    vector<string> errors;
+
+  private:
+    const vector<PendingImage> &pendingImages;
+  };
+
+  template<class TImage>
+  static void write(const string &fileName, itk::ImageIOBase *imageIO, itk::ImageBase<3> *image) {
+    typedef itk::ImageFileWriter<TImage> WriterType;
+    typename WriterType::Pointer writer = WriterType::New();
+    writer->SetFileName(fileName.c_str());
+    writer->SetImageIO(imageIO);
+    writer->SetInput(static_cast<TImage*>(image));
+    writer->SetUseCompression(1);
+    writer->Update();
+  }
+
+  void add(unsigned segmentNumber, itk::ImageBase<3> *image, WriteFunction writeFunction) {
+    stringstream imageFileNameSStream;
+
+    // merged label map is returned as segment 0
+    if(segmentNumber == 0)
+      imageFileNameSStream << outputDirName << "/" << outputPrefix << "labelmap" << fileExtension;
+    else
+      imageFileNameSStream << outputDirName << "/" << outputPrefix << segmentNumber << fileExtension;
+
+    PendingImage pendingImage;
+    pendingImage.fileName = imageFileNameSStream.str();
+    pendingImage.image = image;
+    pendingImage.write = writeFunction;
+    pendingImages.push_back(pendingImage);
+
+    if(pendingImages.size() >= numberOfWriters && !flush())
+      throw -1;
+  }
+
+  string outputDirName, outputPrefix, fileExtension;
+  unsigned numberOfWriters;
+  vector<PendingImage> pendingImages;
+};
+
+
 int main(int argc, char *argv[])
 {
   std::cout << dcmqi_INFO << std::endl;
@@ -20,36 +152,66 @@ int main(int argc, char *argv[])
      || helper::isUndefinedOrPathDoesNotExist(outputDirName, "Output directory"))
     return EXIT_FAILURE;
 
+  set<unsigned> segmentNumbers;
+  for(size_t i=0;i<segments.size();i++){
+    if(segments[i] <= 0){
+      cerr << "ERROR: Segment numbers start from 1!" << endl;
+      return EXIT_FAILURE;
+    }
+    segmentNumbers.insert(unsigned(segments[i]));
+  }
+
+  unsigned firstSlice = 0, lastSlice = numeric_limits<unsigned>::max();
+  if(!sliceRange.empty()){
+    if(sliceRange.size() != 2 || sliceRange[0] < 0 || sliceRange[1] < sliceRange[0]){
+      cerr << "ERROR: Slice range should be specified as first,last slice number!" << endl;
+      return EXIT_FAILURE;
+    }
+    firstSlice = unsigned(sliceRange[0]);
+    lastSlice = unsigned(sliceRange[1]);
+  }
+
   DcmFileFormat sliceFF;
   CHECK_COND(sliceFF.loadFile(inputSEGFileName.c_str()));
   DcmDataset* dataset = sliceFF.getDataset();
 
   try {
-    pair <map<unsigned,ShortImageType::Pointer>, string> result =  dcmqi::ImageSEGConverter::dcmSegmentation2itkimage(dataset);
-
+    const unsigned numberOfThreads = dcmqi::WorkerPool::getNumberOfThreads(threads);
+    const unsigned numberOfWriters = dcmqi::WorkerPool::getNumberOfThreads(writeThreads);
     string outputPrefix = prefix.empty() ? "" : prefix + "-";
 
     string fileExtension = dcmqi::Helper::getFileExtensionFromType(outputType);
 
-    for(map<unsigned,ShortImageType::Pointer>::const_iterator sI=result.first.begin();sI!=result.first.end();++sI){
-      typedef itk::ImageFileWriter<ShortImageType> WriterType;
-      stringstream imageFileNameSStream;
-
-      imageFileNameSStream << outputDirName << "/" << outputPrefix << sI->first << fileExtension;
-
-      WriterType::Pointer writer = WriterType::New();
-      writer->SetFileName(imageFileNameSStream.str().c_str());
-      writer->SetInput(sI->second);
-      writer->SetUseCompression(1);
-      writer->Update();
-    }
+    OFString segmentationType;
+    dataset->findAndGetOFString(DCM_SegmentationType, segmentationType);
+    const bool fractional = segmentationType == "FRACTIONAL" && fractionalOutput != "mask";
+
+    SegmentImageWriter segmentWriter(outputDirName, outputPrefix, fileExtension, numberOfWriters);
+    string metaInfo;
+    if(fractional && fractionalOutput == "argmax")
+      metaInfo = dcmqi::ImageSEGConverter::dcmFractionalSegmentation2labelmap(dataset, segmentWriter,
+                                                                               segmentNumbers, firstSlice, lastSlice,
+                                                                               numberOfThreads);
+    else if(fractional)
+      metaInfo = dcmqi::ImageSEGConverter::dcmFractionalSegmentation2itkimage(dataset, segmentWriter,
+                                                                               fractionalOutput == "probability",
+                                                                               segmentNumbers, firstSlice, lastSlice,
+                                                                               numberOfThreads);
+    else
+      metaInfo = dcmqi::ImageSEGConverter::dcmSegmentation2itkimage(dataset, segmentWriter, mergeSegments,
+                                                                    segmentNumbers, firstSlice, lastSlice,
+                                                                    numberOfThreads);
+
+    // meta.json is only written once all of the segment images are written
+    if(!segmentWriter.flush())
+      throw -1;
 
     stringstream jsonOutput;
     jsonOutput << outputDirName << "/" << outputPrefix << "meta.json";
 
     ofstream outputFile;
     outputFile.open(jsonOutput.str().c_str());
-    outputFile << result.second;
+    outputFile << metaInfo;
     outputFile.close();
 
     return EXIT_SUCCESS;
@@ -31,6 +31,7 @@
 #include "dcmqi/QIICRUIDs.h"
 #include "dcmqi/internal/VersionConfigure.h"
 #include "dcmqi/Helper.h"
+#include "dcmqi/WorkerPool.h"
 
 using namespace std;
 
@@ -90,6 +91,13 @@ int main(int argc, char** argv){
     return EXIT_FAILURE;
   }
 
+  unsigned numberOfThreads = 0;
+  try {
+    numberOfThreads = dcmqi::WorkerPool::getNumberOfThreads(threads);
+  } catch(int) {
+    return EXIT_FAILURE;
+  }
+
   Json::Value metaRoot;
 
   try {
@@ -132,10 +140,12 @@ int main(int argc, char** argv){
   CHECK_COND(report.getImageLibrary().createNewImageLibrary());
   CHECK_COND(report.getImageLibrary().addImageGroup());
 
+  // image library files are read once, in parallel, and used both for the image
+  //  library and for the evidence
+  vector<DcmDataset*> imageLibraryDatasets;
   if(metaRoot.isMember("imageLibrary")){
+    vector<string> imageLibraryFiles;
     for(Json::ArrayIndex i=0;i<metaRoot["imageLibrary"].size();i++){
-
-      DcmFileFormat ff;
       OFString dicomFilePath;
 
       if(imageLibraryDataDir.size())
@@ -143,9 +153,22 @@ int main(int argc, char** argv){
       else
         dicomFilePath = metaRoot["imageLibrary"][i].asCString();
 
-      CHECK_COND(ff.loadFile(dicomFilePath));
+      imageLibraryFiles.push_back(dicomFilePath.c_str());
+    }
+
+    try {
+      imageLibraryDatasets = helper::loadHeaders(imageLibraryFiles, numberOfThreads);
+    } catch(int) {
+      return -1;
+    }
+
+    for(size_t i=0;i<imageLibraryDatasets.size();i++){
+      if(!imageLibraryDatasets[i]){
+        cerr << "ERROR: Failed to read " << imageLibraryFiles[i] << endl;
+        return -1;
+      }
 
-      CHECK_COND(report.getImageLibrary().addImageEntry(*ff.getDataset(),
+      CHECK_COND(report.getImageLibrary().addImageEntry(*imageLibraryDatasets[i],
         TID1600_ImageLibrary::withAllDescriptors));
     }
   }
@@ -477,10 +500,9 @@ int main(int argc, char** argv){
     }
   }
 
-  if(metaRoot.isMember("imageLibrary")){
-    for(Json::ArrayIndex i=0;i<metaRoot["imageLibrary"].size();i++){
-      addFileToEvidence(doc,imageLibraryDataDir,metaRoot["imageLibrary"][i].asString());
-    }
+  for(size_t i=0;i<imageLibraryDatasets.size();i++){
+    CHECK_COND(doc.getCurrentRequestedProcedureEvidence().addItem(*imageLibraryDatasets[i]));
+    delete imageLibraryDatasets[i];
   }
 
   OFCHECK_EQUAL(doc.getDocumentType(), DSRTypes::DT_EnhancedSR);
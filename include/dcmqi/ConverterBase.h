@@ -4,6 +4,8 @@
 // STD includes
 #include <algorithm>
 #include <iostream>
+#include <limits>
+#include <set>
 #include <vector>
 
 // VNL includes
@@ -17,6 +19,7 @@
 #include <dcmtk/dcmiod/iodmacro.h>
 #include <dcmtk/dcmiod/modenhequipment.h>
 #include <dcmtk/dcmiod/modequipment.h>
+#include <dcmtk/dcmfg/fgderimg.h>
 #include <dcmtk/dcmfg/fginterface.h>
 #include <dcmtk/dcmfg/fgplanor.h>
 #include <dcmtk/dcmfg/fgplanpo.h>
@@ -26,13 +29,13 @@
 // ITK includes
 #include <itkImageFileReader.h>
 #include <itkImageFileWriter.h>
-#include <itkLabelImageToLabelMapFilter.h>
 
 // DCMQI includes
 #include "dcmqi/Exceptions.h"
 #include "dcmqi/JSONMetaInformationHandlerBase.h"
 #include "dcmqi/QIICRUIDs.h"
 #include "dcmqi/QIICRConstants.h"
+#include "dcmqi/SourceImageIndex.h"
 
 using namespace std;
 
@@ -95,148 +98,44 @@ namespace dcmqi {
       return 0;
     }
 
+    // Geometry of the frames of a multi-frame object, computed in a single pass over the
+    //  functional groups; the decoders reuse the positions in their per-frame loops
+    struct FrameGeometry {
+      // ImagePositionPatient of the frames, three values per frame
+      vector<double> framePositions;
+      // position of the frames along the slice direction
+      vector<double> frameDistances;
+      // frame ids ordered along the slice direction, as sorted by FrameSorterIPP
+      vector<Uint32> sortedFrames;
+      // distinct positions along the slice direction, in increasing order
+      vector<double> sliceDistances;
+      double origin[3];
+      double sliceSpacing, sliceExtent;
+    };
+
+    static int computeFrameGeometry(FGInterface &fgInterface, FrameGeometry &frameGeometry);
+
+    // Slice number of every frame in the given image, which is initialized from the
+    //  frame geometry. Throws if a frame is outside of the image geometry.
+    static vector<unsigned> getFrameSlices(const FrameGeometry &frameGeometry, const itk::ImageBase<3> *image);
+
     template <class T>
-    static int computeVolumeExtent(FGInterface &fgInterface, vnl_vector<double> &sliceDirection, T &imageOrigin,
-                                   double &sliceSpacing, double &sliceExtent) {
+    static int computeVolumeExtent(FGInterface &fgInterface, T &imageOrigin,
+                                   double &sliceSpacing, double &sliceExtent, FrameGeometry &frameGeometry) {
       // Size
       // Rows/Columns can be read directly from the respective attributes
       // For number of slices, consider that all segments must have the same number of frames.
       //   If we have FoR UID initialized, this means every segment should also have Plane
       //   Position (Patient) initialized. So we can get the number of slices by looking
       //   how many per-frame functional groups a segment has.
+      if(computeFrameGeometry(fgInterface, frameGeometry))
+        return EXIT_FAILURE;
 
-      vector<double> originDistances;
-      map<OFString, double> originStr2distance;
-      map<OFString, unsigned> frame2overlap;
-      double minDistance = 0.0;
-
-      sliceSpacing = 0;
-
-      unsigned numFrames = fgInterface.getNumberOfFrames();
-
-      /* Framesorter is to be moved to DCMTK at some point
-       * in the future. For now it is causing build issues on windows
-
-      FrameSorterIPP fsIPP;
-      FrameSorterIPP::Results sortResults;
-      fsIPP.setSorterInput(&fgInterface);
-      fsIPP.sort(sortResults);
-
-      */
-
-      // Determine ordering of the frames, keep mapping from ImagePositionPatient string
-      //   to the distance, and keep track (just out of curiousity) how many frames overlap
-      vnl_vector<double> refOrigin(3);
-      {
-        OFBool isPerFrame;
-        FGPlanePosPatient *planposfg = OFstatic_cast(FGPlanePosPatient*,
-                                                     fgInterface.get(0, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-        for(int j=0;j<3;j++){
-          OFString planposStr;
-          if(planposfg->getImagePositionPatient(planposStr, j).good()){
-            refOrigin[j] = atof(planposStr.c_str());
-          } else {
-            cerr << "Failed to read patient position" << endl;
-          }
-        }
-      }
-
-      for(size_t frameId=0;frameId<numFrames;frameId++){
-        OFBool isPerFrame;
-        FGPlanePosPatient *planposfg = OFstatic_cast(FGPlanePosPatient*,
-                                                     fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-
-        if(!planposfg){
-          cerr << "PlanePositionPatient is missing" << endl;
-          return EXIT_FAILURE;
-        }
-
-        if(!isPerFrame){
-          cerr << "PlanePositionPatient is required for each frame!" << endl;
-          return EXIT_FAILURE;
-        }
-
-        vnl_vector<double> sOrigin;
-        OFString sOriginStr = "";
-        sOrigin.set_size(3);
-        for(int j=0;j<3;j++){
-          OFString planposStr;
-          if(planposfg->getImagePositionPatient(planposStr, j).good()){
-            sOrigin[j] = atof(planposStr.c_str());
-            sOriginStr += planposStr;
-            if(j<2)
-              sOriginStr+='/';
-          } else {
-            cerr << "Failed to read patient position" << endl;
-            return EXIT_FAILURE;
-          }
-        }
-
-        // check if this frame has already been encountered
-        if(originStr2distance.find(sOriginStr) == originStr2distance.end()){
-          vnl_vector<double> difference;
-          difference.set_size(3);
-          difference[0] = sOrigin[0]-refOrigin[0];
-          difference[1] = sOrigin[1]-refOrigin[1];
-          difference[2] = sOrigin[2]-refOrigin[2];
-          double dist = dot_product(difference,sliceDirection);
-          frame2overlap[sOriginStr] = 1;
-          originStr2distance[sOriginStr] = dist;
-          assert(originStr2distance.find(sOriginStr) != originStr2distance.end());
-          originDistances.push_back(dist);
-
-          if(frameId==0){
-            minDistance = dist;
-            imageOrigin[0] = sOrigin[0];
-            imageOrigin[1] = sOrigin[1];
-            imageOrigin[2] = sOrigin[2];
-          }
-          else if(dist<minDistance){
-            imageOrigin[0] = sOrigin[0];
-            imageOrigin[1] = sOrigin[1];
-            imageOrigin[2] = sOrigin[2];
-            minDistance = dist;
-          }
-        } else {
-          frame2overlap[sOriginStr]++;
-        }
-      }
-
-      // it IS possible to have a segmentation object containing just one frame!
-      if(numFrames>1){
-        // WARNING: this should be improved further. Spacing should be calculated for
-        //  consecutive frames of the individual segment. Right now, all frames are considered
-        //  indiscriminately. Question is whether it should be computed at all, considering we do
-        //  not have any information about whether the 2 frames are adjacent or not, so perhaps we should
-        //  always rely on the declared spacing, and not even try to compute it?
-        // TODO: discuss this with the QIICR team!
-
-        // sort all unique distances, this will be used to check consistency of
-        //  slice spacing, and also to locate the slice position from ImagePositionPatient
-        //  later when we read the segments
-        sort(originDistances.begin(), originDistances.end());
-
-        sliceSpacing = fabs(originDistances[0]-originDistances[1]);
-
-        // for(size_t i=1;i<originDistances.size(); i++){
-          // float dist1 = fabs(originDistances[i-1]-originDistances[i]);
-          // float delta = sliceSpacing-dist1;
-        // }
-
-        sliceExtent = fabs(originDistances[0]-originDistances[originDistances.size()-1]);
-        unsigned overlappingFramesCnt = 0;
-        for(map<OFString, unsigned>::const_iterator it=frame2overlap.begin();
-            it!=frame2overlap.end();++it){
-            if(it->second>1)
-              overlappingFramesCnt++;
-        }
-
-        cout << "Total frames: " << numFrames << endl;
-        cout << "Total frames with unique IPP: " << originDistances.size() << endl;
-        cout << "Total overlapping frames: " << overlappingFramesCnt << endl;
-        cout << "Origin: " << imageOrigin << endl;
-      }
-
+      imageOrigin[0] = frameGeometry.origin[0];
+      imageOrigin[1] = frameGeometry.origin[1];
+      imageOrigin[2] = frameGeometry.origin[2];
+      sliceSpacing = frameGeometry.sliceSpacing;
+      sliceExtent = frameGeometry.sliceExtent;
       return 0;
     }
 
@@ -267,37 +166,87 @@ namespace dcmqi {
 
     // AF: I could not quickly figure out how to template this function over image type - suggestions are welcomed!
     static vector<vector<int> > getSliceMapForSegmentation2DerivationImage(const vector<DcmDataset*> dcmDatasets,
-                                                                                       const ShortImageType::Pointer &labelImage) {
+                                                                           const itk::ImageBase<3> *labelImage,
+                                                                           vector<vector<OFVector<Uint16> > > *slice2frameNumbers = NULL) {
+      SourceImageIndex sourceImageIndex(dcmDatasets);
+      return getSliceMapForSegmentation2DerivationImage(sourceImageIndex, labelImage, slice2frameNumbers);
+    }
+
+    // If slice2frameNumbers is given, it receives for every instance of the slice map
+    //  the numbers of the frames of that instance located within the slice (none for
+    //  single-frame instances), to be set as ReferencedFrameNumber
+    static vector<vector<int> > getSliceMapForSegmentation2DerivationImage(SourceImageIndex &sourceImageIndex,
+                                                                           const itk::ImageBase<3> *labelImage,
+                                                                           vector<vector<OFVector<Uint16> > > *slice2frameNumbers = NULL) {
       // Find mapping from the segmentation slice number to the derivation image
       // Assume that orientation of the segmentation is the same as the source series
-      unsigned numLabelSlices = labelImage->GetLargestPossibleRegion().GetSize()[2];
-      vector<vector<int> > slice2derimg(numLabelSlices);
-      vector<bool> slice2derimgPresent(numLabelSlices, false);
+      vector<vector<size_t> > slice2frames = sourceImageIndex.getSliceMap(labelImage);
+      vector<vector<int> > slice2derimg(slice2frames.size());
+      if(slice2frameNumbers){
+        slice2frameNumbers->clear();
+        slice2frameNumbers->resize(slice2frames.size());
+      }
 
       int slicesMapped = 0;
-      for(size_t i=0;i<dcmDatasets.size();i++){
-        OFString ippStr;
-        ShortImageType::PointType ippPoint;
-        ShortImageType::IndexType ippIndex;
-        for(int j=0;j<3;j++){
-          CHECK_COND(dcmDatasets[i]->findAndGetOFString(DCM_ImagePositionPatient, ippStr, j));
-          ippPoint[j] = atof(ippStr.c_str());
-        }
-        if(!labelImage->TransformPhysicalPointToIndex(ippPoint, ippIndex)){
-          cout << "image position: " << ippPoint << endl;
-          cerr << "ippIndex: " << ippIndex << endl;
-          // if certain DICOM instance does not map to a label slice, just skip it
-          continue;
+      for(size_t slice=0;slice<slice2frames.size();slice++){
+        for(size_t i=0;i<slice2frames[slice].size();i++){
+          // frames of a multi-frame instance are referenced through the instance
+          const SourceImageIndex::SourceFrame &frame = sourceImageIndex.getFrame(slice2frames[slice][i]);
+          int datasetId = int(frame.datasetId);
+          vector<int>::iterator derimg = find(slice2derimg[slice].begin(), slice2derimg[slice].end(), datasetId);
+          if(derimg == slice2derimg[slice].end()){
+            slice2derimg[slice].push_back(datasetId);
+            if(slice2frameNumbers)
+              (*slice2frameNumbers)[slice].push_back(OFVector<Uint16>());
+            derimg = slice2derimg[slice].end()-1;
+          }
+          if(slice2frameNumbers && frame.frameNumber){
+            // ReferencedFrameNumber is set through DCMTK as 16-bit values
+            if(frame.frameNumber > numeric_limits<Uint16>::max()){
+              cerr << "ERROR: Frame " << frame.frameNumber << " of source dataset " << datasetId <<
+              " cannot be referenced, frame numbers above " << numeric_limits<Uint16>::max() <<
+              " are not supported!" << endl;
+              throw -1;
+            }
+            (*slice2frameNumbers)[slice][derimg-slice2derimg[slice].begin()].push_back(Uint16(frame.frameNumber));
+          }
         }
-        slice2derimg[ippIndex[2]].push_back(i);
-        if(slice2derimgPresent[ippIndex[2]] == false)
+        if(!slice2derimg[slice].empty())
           slicesMapped++;
-        slice2derimgPresent[ippIndex[2]] = true;
       }
-      cout << slicesMapped << " of " << slice2derimgPresent.size() << " slices mapped to source DICOM images" << endl;
+      cout << slicesMapped << " of " << slice2derimg.size() << " slices mapped to source DICOM images" << endl;
       return slice2derimg;
     }
 
+    // Sets ReferencedFrameNumber of the source image items created for the instances of
+    //  a slice, as listed by getSliceMapForSegmentation2DerivationImage()
+    static void setReferencedFrameNumbers(const OFVector<SourceImageItem*> &srcimgItems,
+                                          const vector<OFVector<Uint16> > &frameNumbers) {
+      for(size_t i=0;i<srcimgItems.size() && i<frameNumbers.size();i++){
+        if(!frameNumbers[i].empty())
+          CHECK_COND(srcimgItems[i]->getImageSOPInstanceReference().setReferencedFrameNumber(frameNumbers[i]));
+      }
+    }
+
+    // Adds the SOP instances of the given source datasets to the referenced series item,
+    //  each instance once
+    static void addReferencedInstances(const vector<DcmDataset*> &dcmDatasets, const set<int> &datasetIds,
+                                       IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem &refseriesItem) {
+      OFVector<SOPInstanceReferenceMacro*> &refinstances = refseriesItem.getReferencedInstanceItems();
+      set<OFString> instanceUIDs;
+      OFString classUID, instanceUID;
+      for(set<int>::const_iterator dI=datasetIds.begin();dI!=datasetIds.end();++dI){
+        CHECK_COND(dcmDatasets[*dI]->findAndGetOFString(DCM_SOPClassUID, classUID));
+        CHECK_COND(dcmDatasets[*dI]->findAndGetOFString(DCM_SOPInstanceUID, instanceUID));
+        if(!instanceUIDs.insert(instanceUID).second)
+          continue;
+        SOPInstanceReferenceMacro *refinstancesItem = new SOPInstanceReferenceMacro();
+        CHECK_COND(refinstancesItem->setReferencedSOPClassUID(classUID));
+        CHECK_COND(refinstancesItem->setReferencedSOPInstanceUID(instanceUID));
+        refinstances.push_back(refinstancesItem);
+      }
+    }
+
   };
 
 }
@@ -0,0 +1,66 @@
+#ifndef DCMQI_DICOMDIRECTORYSCANNER_H
+#define DCMQI_DICOMDIRECTORYSCANNER_H
+
+// ITK includes
+#include <itkImageBase.h>
+
+// JSON includes
+#include <json/json.h>
+
+// STD includes
+#include <map>
+#include <string>
+#include <vector>
+
+namespace dcmqi {
+
+  // Finds the source images of a segmentation or parametric map in a directory.
+  //
+  // Files are classified by their preamble and meta header, and only the leading
+  //  attributes of the dataset (up to ImagePositionPatient) are parsed to group the
+  //  files by series. The result of a scan can be kept in an index file: when the
+  //  same directory is scanned again, files whose size and modification time did not
+  //  change are taken from the index without being opened. Only the selection of the
+  //  files is cached, the caller loads the files returned by getMatchingFiles().
+  class DicomDirectoryScanner {
+
+  public:
+    struct FileInfo {
+      FileInfo() : modificationTime(0), size(0), isDicom(false), hasPosition(false) {
+        position[0] = position[1] = position[2] = 0;
+      }
+      std::string path;
+      Json::UInt64 modificationTime, size;
+      bool isDicom, hasPosition;
+      std::string seriesInstanceUID, sopInstanceUID;
+      double position[3];
+    };
+
+    // Scans the directory recursively, using up to numberOfThreads threads (0 for the
+    //  ITK default). If indexFileName is not empty, the index is read from that file
+    //  when it exists, and updated after the scan.
+    void scan(const std::string &directory, const std::string &indexFileName = "", unsigned numberOfThreads = 0);
+
+    // Returns the files of the series with the most instances positioned within the
+    //  geometry. If no series matches (e.g., a multi-frame source, which has no
+    //  position outside of the functional groups), all DICOM files are returned.
+    //  Returns false, and reports the series, if more than one series matches equally
+    //  well (e.g., a repeated acquisition).
+    bool getMatchingFiles(const itk::ImageBase<3> *geometry, std::vector<std::string> &matchingFiles) const;
+
+    const std::vector<FileInfo>& getFiles() const { return files; }
+
+  private:
+    class ClassifyTask;
+
+    // message is set if the file is reported to the user
+    static void classifyFile(FileInfo &info, std::string &message);
+    static bool readIndex(const std::string &indexFileName, std::map<std::string, FileInfo> &index);
+    bool writeIndex(const std::string &indexFileName) const;
+
+    std::vector<FileInfo> files;
+  };
+
+}
+
+#endif //DCMQI_DICOMDIRECTORYSCANNER_H
@@ -0,0 +1,52 @@
+#ifndef DCMQI_FRAMEREADER_H
+#define DCMQI_FRAMEREADER_H
+
+// DCMTK includes
+#include <dcmtk/dcmdata/dcdatset.h>
+#include <dcmtk/dcmdata/dcfcache.h>
+
+// STD includes
+#include <vector>
+
+namespace dcmqi {
+
+  // Reads individual frames of native (uncompressed) pixel data on demand.
+  //
+  // DCMTK IOD classes copy all of the frames when a dataset is loaded, which also
+  //  forces the whole pixel data element to be read from the file. detach() takes the
+  //  pixel data element out of the dataset before the IOD is loaded, so that only the
+  //  header and functional groups are parsed; frames are then read from the element
+  //  one at a time. Since DcmFileFormat::loadFile() leaves large element values in the
+  //  file, this only touches the bytes of the frames that are actually needed.
+  class FrameReader {
+
+  public:
+    FrameReader(DcmDataset *dataset, const DcmTagKey &pixelDataTag);
+    // puts the pixel data element back into the dataset, if it was detached
+    ~FrameReader();
+
+    // Returns false if the pixel data cannot be read frame by frame (missing,
+    //  encapsulated or deflated), in which case the dataset is left unchanged
+    bool detach();
+    void attach();
+    bool isDetached() const { return pixelData != NULL; }
+
+    // Reads the frame with frameId into buffer, which must hold (bitsPerFrame+7)/8
+    //  bytes. Frames are assumed to be stored back to back, which for binary
+    //  segmentations means that a frame may start in the middle of a byte; the bits
+    //  are shifted so that the first pixel of the frame is in the least significant
+    //  bit of buffer[0].
+    bool readFrame(size_t frameId, size_t bitsPerFrame, Uint8 *buffer,
+                   E_ByteOrder byteOrder = gLocalByteOrder);
+
+  private:
+    DcmDataset *dataset;
+    DcmTagKey pixelDataTag;
+    DcmElement *pixelData;
+    DcmFileCache fileCache;
+    std::vector<Uint8> readBuffer;
+  };
+
+}
+
+#endif //DCMQI_FRAMEREADER_H
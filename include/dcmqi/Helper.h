@@ -2,6 +2,7 @@
 #define DCMQI_HELPER_H
 
 // DCMTK includes
+#include <dcmtk/dcmdata/dcfilefo.h>
 #include <dcmtk/dcmfg/fgderimg.h>
 #include <dcmtk/dcmiod/iodmacro.h>
 #include <dcmtk/dcmseg/segdoc.h>
@@ -12,6 +13,7 @@
 #include <string>
 #include <vector>
 #include <map>
+#include <set>
 #include <algorithm>
 
 // DCMQI includes
@@ -43,9 +45,30 @@ namespace dcmqi {
 
     static string getFileExtensionFromType(const string& type);
     static vector<string> getFileListRecursively(string directory);
-    static vector<DcmDataset*> loadDatasets(const vector<string>& dicomImageFiles);
-
-    static string floatToStrScientific(float f);
+    // Source images are only needed for their attributes (position, UIDs, hierarchy), so
+    //  the datasets are loaded without reading the pixel data; see loadHeader().
+    //  Files are parsed on up to numberOfThreads threads (0 for the ITK default), the
+    //  result is in the order of the input list.
+    //  Duplicates (by SOPInstanceUID) and files without PixelData are skipped and
+    //  counted in the optional summary.
+    struct DatasetLoadSummary {
+      DatasetLoadSummary() : failed(0), noPixelData(0), duplicates(0) {}
+      size_t failed, noPixelData, duplicates;
+    };
+    static vector<DcmDataset*> loadDatasets(const vector<string>& dicomImageFiles, unsigned numberOfThreads=0,
+                                            DatasetLoadSummary *summary=NULL);
+    // Same as above, without any checks; the entry of a file that failed to load is NULL.
+    //  Throws if loading was interrupted, none of the datasets are returned then.
+    static vector<DcmDataset*> loadHeaders(const vector<string>& dicomImageFiles, unsigned numberOfThreads=0);
+    static OFCondition loadHeader(DcmFileFormat &fileFormat, const string &fileName);
+
+    // Size of a buffer that can hold any value formatted by floatToDecimalString,
+    //  i.e., the 16 characters of a Decimal String (DS) and the terminating zero
+    static const size_t DecimalStringBufferSize = 17;
+    // Formats f into buffer as a DS value, independently of the current locale and
+    //  without allocating. Uses the shortest representation that parses back to f
+    //  (at most 9 significant digits), in fixed notation whenever it fits. Returns buffer.
+    static char* floatToDecimalString(float f, char *buffer);
     static void tokenizeString(string str, vector<string> &tokens, string delimiter);
     static void splitString(string str, string &head, string &tail, string delimiter);
 
@@ -64,6 +87,10 @@ namespace dcmqi {
     static void checkValidityOfFirstSrcImage(DcmSegmentation *segdoc);
 
     static CodeSequenceMacro* createNewCodeSequence(const string& code, const string& designator, const string& meaning);
+
+  private:
+    // Worker task for the parallel loading, defined in the implementation file
+    class HeaderLoadTask;
   };
 
 }
@@ -6,6 +6,10 @@
 #include <zlib.h>           /* for zlibVersion() */
 #endif
 
+// STD includes
+#include <limits>
+#include <set>
+
 // DCMTK includes
 #include <dcmtk/dcmfg/fgderimg.h>
 #include <dcmtk/dcmfg/fgseg.h>
@@ -13,40 +17,216 @@
 #include <dcmtk/dcmseg/segment.h>
 #include <dcmtk/dcmseg/segutils.h>
 #include <dcmtk/dcmdata/dcrledrg.h>
+#include <dcmtk/ofstd/ofmem.h>
 
 // ITK includes
 #include <itkImageDuplicator.h>
 #include <itkImageRegionConstIterator.h>
-#include <itkLabelStatisticsImageFilter.h>
-#include <itkBinaryThresholdImageFilter.h>
 #include <itkChangeInformationImageFilter.h>
+#include <itkMutexLockHolder.h>
 
 // DCMQI includes
 #include "dcmqi/ConverterBase.h"
+#include "dcmqi/FrameReader.h"
 #include "dcmqi/JSONSegmentationMetaInformationHandler.h"
+#include "dcmqi/WorkerPool.h"
 
 using namespace std;
 
 
-typedef itk::LabelImageToLabelMapFilter<ShortImageType> LabelToLabelMapFilterType;
+// Per-segment inputs of fractional segmentations: probabilities in the range [0,1],
+//  or the fractional values as stored in the segmentation
+typedef float ProbabilityPixelType;
+typedef itk::Image<ProbabilityPixelType, 3> ProbabilityImageType;
+typedef itk::ImageFileReader<ProbabilityImageType> ProbabilityReaderType;
+typedef Uint8 FractionalPixelType;
+typedef itk::Image<FractionalPixelType, 3> FractionalImageType;
+typedef itk::ImageFileReader<FractionalImageType> FractionalReaderType;
 
 namespace dcmqi {
 
+  // Receives the segment images produced by ImageSEGConverter::dcmSegmentation2itkimage(),
+  //  one at a time, as soon as all of the frames of the segment are decoded
+  class SegmentImageVisitor {
+  public:
+    virtual ~SegmentImageVisitor() {}
+    virtual void visit(unsigned segmentNumber, ShortImageType::Pointer segmentImage) = 0;
+  };
+
+  // Receives the segment images produced by ImageSEGConverter::dcmFractionalSegmentation2itkimage(),
+  //  either as probabilities or as the stored fractional values
+  class FractionalSegmentImageVisitor {
+  public:
+    virtual ~FractionalSegmentImageVisitor() {}
+    virtual void visit(unsigned segmentNumber, ProbabilityImageType::Pointer probabilityImage) = 0;
+    virtual void visit(unsigned segmentNumber, FractionalImageType::Pointer fractionalImage) = 0;
+  };
+
   class ImageSEGConverter : public ConverterBase {
 
   public:
     static DcmDataset* itkimage2dcmSegmentation(vector<DcmDataset*> dcmDatasets,
                                                 vector<ShortImageType::Pointer> segmentations,
                                                 const string &metaData,
-                                                bool skipEmptySlices=true);
-
-
-    static pair <map<unsigned,ShortImageType::Pointer>, string> dcmSegmentation2itkimage(DcmDataset *segDataset);
+                                                bool skipEmptySlices=true,
+                                                bool skipEmptyFrames=false,
+                                                unsigned numberOfThreads=0);
+
+    // Creates a FRACTIONAL segmentation with one segment per image, described by the only
+    //  segment listed for the corresponding file in the meta information. Probabilities
+    //  are scaled to 0..maximumFractionalValue; fractional values larger than
+    //  maximumFractionalValue are clamped. Empty slices and frames (i.e., those with
+    //  all of the fractional values equal to 0) are handled as in the binary case.
+    static DcmDataset* itkimage2dcmFractionalSegmentation(vector<DcmDataset*> dcmDatasets,
+        vector<ProbabilityImageType::Pointer> probabilityMaps,
+        const string &metaData,
+        DcmSegTypes::E_SegmentationFractionalType fractionalType=DcmSegTypes::SFT_PROBABILITY,
+        Uint8 maximumFractionalValue=255,
+        bool skipEmptySlices=true,
+        bool skipEmptyFrames=false,
+        unsigned numberOfThreads=0);
+    static DcmDataset* itkimage2dcmFractionalSegmentation(vector<DcmDataset*> dcmDatasets,
+        vector<FractionalImageType::Pointer> fractionalMaps,
+        const string &metaData,
+        DcmSegTypes::E_SegmentationFractionalType fractionalType=DcmSegTypes::SFT_PROBABILITY,
+        Uint8 maximumFractionalValue=255,
+        bool skipEmptySlices=true,
+        bool skipEmptyFrames=false,
+        unsigned numberOfThreads=0);
+
+
+    // Returns one image per segment, keyed by the segment number. With mergeSegments,
+    //  a single label map holding all of the segments is returned under the key 0
+    //  instead; if the segments overlap, each segment image is cropped to the bounding
+    //  box of that segment (with the origin adjusted accordingly).
+    // Only the segments listed in segmentNumbers (all, if empty) and the slices
+    //  firstSlice..lastSlice (0-based, inclusive) are decoded; the output images
+    //  cover just that range of slices.
+    // The slices of an image are decoded on up to numberOfThreads threads (0 for the
+    //  ITK default).
+    static pair <map<unsigned,ShortImageType::Pointer>, string> dcmSegmentation2itkimage(DcmDataset *segDataset,
+        bool mergeSegments=false,
+        const set<unsigned> &segmentNumbers=set<unsigned>(),
+        unsigned firstSlice=0, unsigned lastSlice=numeric_limits<unsigned>::max(),
+        unsigned numberOfThreads=0);
+    // Same as above, but passes each image to the visitor instead of keeping all of them
+    //  in memory; returns the meta information
+    static string dcmSegmentation2itkimage(DcmDataset *segDataset, SegmentImageVisitor &visitor,
+        bool mergeSegments=false,
+        const set<unsigned> &segmentNumbers=set<unsigned>(),
+        unsigned firstSlice=0, unsigned lastSlice=numeric_limits<unsigned>::max(),
+        unsigned numberOfThreads=0);
+
+    // Decodes a FRACTIONAL segmentation into one image per segment, holding either the
+    //  probabilities (stored values divided by MaximumFractionalValue) or the stored
+    //  values. Segments, slices and threads are selected as for dcmSegmentation2itkimage().
+    static string dcmFractionalSegmentation2itkimage(DcmDataset *segDataset, FractionalSegmentImageVisitor &visitor,
+        bool probabilities=true,
+        const set<unsigned> &segmentNumbers=set<unsigned>(),
+        unsigned firstSlice=0, unsigned lastSlice=numeric_limits<unsigned>::max(),
+        unsigned numberOfThreads=0);
+    // Decodes a FRACTIONAL segmentation into a single label map, passed to the visitor
+    //  under the key 0, that holds for every voxel the segment with the largest
+    //  fractional value (0 if all of them are 0, the lowest segment number on ties).
+    //  Only one slice of fractional values is kept at a time for each thread.
+    static string dcmFractionalSegmentation2labelmap(DcmDataset *segDataset, SegmentImageVisitor &visitor,
+        const set<unsigned> &segmentNumbers=set<unsigned>(),
+        unsigned firstSlice=0, unsigned lastSlice=numeric_limits<unsigned>::max(),
+        unsigned numberOfThreads=0);
 
  private:
 
+    // Bit-packed masks of the non-empty slices of a single label, and the bounding
+    //  box of the label, collected in a single pass over the label image
+    struct LabelFrames {
+      LabelFrames() : label(0) {}
+
+      short label;
+      // xmin, xmax, ymin, ymax, zmin, zmax (same layout as itk::LabelStatisticsImageFilter)
+      unsigned bbox[6];
+      // slice number -> frame mask with one bit per pixel, first pixel in the least significant bit
+      map<unsigned, vector<Uint8> > slices;
+    };
+
+    // Helper classes defined in the implementation file
+    class SegmentImageCollector;
+    class SegmentationFrameWriter;
+    class LabelScanTask;
+    class SlicePositionTask;
+    class FramePreparationTask;
+    template<class TImage> class FractionalScanTask;
+    template<class TImage> class FractionalFramePreparationTask;
+    class FrameDecodeTask;
+    class FractionalFrameDecodeTask;
+
+    // Encoding helpers shared by the binary and the fractional encoders
+    static void initializeSegmentation(DcmSegmentation *segdoc, DcmDataset *sourceDataset,
+                                       const itk::ImageBase<3> *image);
+    static bool computeSlicePositions(const itk::ImageBase<3> *image, vector<char> &slicePositions,
+                                      unsigned numberOfThreads);
+    static DcmSegment* createSegment(SegmentAttributes *segmentAttributes);
+    static DcmDataset* writeSegmentation(DcmSegmentation *segdoc, JSONSegmentationMetaInformationHandler &metaInfo,
+                                         DcmDataset *sourceDataset);
+
+    template<class TImage>
+    static DcmDataset* encodeFractionalSegmentation(vector<DcmDataset*> &dcmDatasets,
+        const vector<typename TImage::Pointer> &images, const string &metaData,
+        DcmSegTypes::E_SegmentationFractionalType fractionalType, Uint8 maximumFractionalValue,
+        bool skipEmptySlices, bool skipEmptyFrames, unsigned numberOfThreads);
+    // Fractional value stored for a pixel of the input image
+    static Uint8 getFractionalValue(ProbabilityPixelType probability, Uint8 maximumFractionalValue);
+    static Uint8 getFractionalValue(FractionalPixelType value, Uint8 maximumFractionalValue);
+
+    // Frames to be expanded into one slice of an output image, with the value of each
+    typedef vector<pair<size_t, ShortPixelType> > SliceFrames;
+    // Expands the frames into the image, one slice per work item; returns true if
+    //  any of the pixels was set by more than one frame with different values
+    static bool expandSlices(DcmSegmentation *segdoc, FrameReader &frameReader, bool binary, size_t frameSize,
+                             const vector<SliceFrames> &sliceFrames, ShortPixelType *imageBuffer,
+                             unsigned numberOfThreads);
+
+    static void scanLabelFrames(const ShortImageType::Pointer &labelImage, map<short,LabelFrames> &labelFrames,
+                                unsigned numberOfThreads);
+    static void scanLabelFrames(const ShortImageType::Pointer &labelImage, unsigned firstSlice, unsigned lastSlice,
+                                map<short,LabelFrames> &labelFrames);
+    static void mergeLabelFrames(map<short,LabelFrames> &labelFrames, map<short,LabelFrames> &slabLabelFrames);
+    static void unpackLabelFrame(const Uint8 *packedFrame, Uint8 *frameData, size_t frameSize);
+
+    // Decoding helpers; expandFrame() and expandBinaryFrame() return true if any of the
+    //  pixels was already set to a value different from the one being written
+    static bool expandBinaryFrame(const Uint8 *packedFrame, size_t frameSize,
+                                  ShortPixelType value, ShortPixelType *sliceBuffer);
+    static bool expandFrame(const Uint8 *frameData, bool binary, size_t frameSize,
+                            ShortPixelType value, ShortPixelType *sliceBuffer);
+    static void expandFrameRegion(const Uint8 *frameData, bool binary, unsigned columns,
+                                  const unsigned *bbox, ShortPixelType value, ShortPixelType *sliceBuffer);
+    static bool getFrameBoundingBox(const Uint8 *frameData, bool binary,
+                                    unsigned columns, unsigned rows, unsigned *bbox);
+    static const Uint8* getFrameData(DcmSegmentation *segdoc, FrameReader &frameReader, size_t frameId,
+                                     bool binary, size_t frameSize, vector<Uint8> &frameBuffer);
+    template<class TImage>
+    static typename TImage::Pointer createSegmentImage(const ShortImageType::Pointer &referenceImage,
+                                                       const ShortImageType::RegionType &region);
+
+    // Loads the segmentation and groups the frames to be decoded by segment. segImage
+    //  gets the geometry of the whole volume (without a buffer), imageRegion the slices
+    //  firstSlice..lastSlice, with lastSlice limited to the last slice of the volume.
+    //  The caller owns the returned document.
+    static DcmSegmentation* loadSegmentation(DcmDataset *segDataset, FrameReader &frameReader,
+                                             const set<unsigned> &segmentNumbers,
+                                             unsigned firstSlice, unsigned &lastSlice,
+                                             ShortImageType::Pointer &segImage,
+                                             ShortImageType::RegionType &imageRegion,
+                                             map<unsigned, vector<size_t> > &segment2frames,
+                                             vector<unsigned> &frameSlices,
+                                             JSONSegmentationMetaInformationHandler &metaInfo);
+    static void checkFractionalSegmentation(DcmSegmentation *segdoc);
+    static Uint16 getMaximumFractionalValue(DcmDataset *segDataset);
+
     static void populateMetaInformationFromDICOM(DcmDataset *segDataset, DcmSegmentation *segdoc,
                                                  JSONSegmentationMetaInformationHandler &metaInfo);
+    static void populateSegmentAttributes(DcmSegment *segment, unsigned segmentId,
+                                          JSONSegmentationMetaInformationHandler &metaInfo);
   };
 
 }
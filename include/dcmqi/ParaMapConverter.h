@@ -19,6 +19,7 @@
 
 // DCMQI includes
 #include "dcmqi/ConverterBase.h"
+#include "dcmqi/FrameReader.h"
 #include "dcmqi/JSONParametricMapMetaInformationHandler.h"
 
 typedef IODFloatingPointImagePixelModule::value_type FloatPixelType;
@@ -39,10 +40,7 @@ namespace dcmqi {
 
     static pair <FloatImageType::Pointer, string> paramap2itkimage(DcmDataset *pmapDataset);
   protected:
-    static OFCondition addFrame(DPMParametricMapIOD &map, const FloatImageType::Pointer &parametricMapImage,
-                                const JSONParametricMapMetaInformationHandler &metaInfo, const unsigned long frameNo, OFVector<FGBase*> perFrameGroups);
-
-    static void populateMetaInformationFromDICOM(DcmDataset *pmapDataset,
+    static void populateMetaInformationFromDICOM(DcmDataset *pmapDataset, DPMParametricMapIOD *pMapDoc,
                                                  JSONParametricMapMetaInformationHandler &metaInfo);
   };
 
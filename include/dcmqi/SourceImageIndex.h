@@ -0,0 +1,70 @@
+#ifndef DCMQI_SOURCEIMAGEINDEX_H
+#define DCMQI_SOURCEIMAGEINDEX_H
+
+// DCMTK includes
+#include <dcmtk/dcmdata/dcdatset.h>
+#include <dcmtk/dcmfg/fginterface.h>
+#include <dcmtk/dcmfg/fgplanpo.h>
+
+// ITK includes
+#include <itkImageBase.h>
+
+// STD includes
+#include <vector>
+
+namespace dcmqi {
+
+  // Locates the source image frames that correspond to the slices of a volume.
+  //
+  // ImagePositionPatient of every source frame is parsed once when the index is
+  //  created; single-frame instances contribute one frame, enhanced multi-frame
+  //  instances one frame per frame of their functional groups, whether the position
+  //  is per-frame or shared. For a given slice direction the positions are projected
+  //  on the slice normal and sorted, so that the frames of a slice are found with a
+  //  binary search. The sorted order is kept for as long as the slice direction does
+  //  not change, which lets encoders and decoders query the same index for several
+  //  volumes of the same geometry.
+  class SourceImageIndex {
+
+  public:
+    struct SourceFrame {
+      // index of the dataset in the list the index was created from
+      size_t datasetId;
+      // 1-based frame number for multi-frame instances, 0 for single-frame instances
+      Uint32 frameNumber;
+      double position[3];
+    };
+
+    SourceImageIndex(const std::vector<DcmDataset*> &datasets);
+
+    size_t getNumberOfFrames() const { return frames.size(); }
+    const SourceFrame& getFrame(size_t frameId) const { return frames[frameId]; }
+
+    // Returns the ids of the frames whose position projected on sliceNormal falls
+    //  within [distance-tolerance, distance+tolerance), in the order of the projection
+    void findFrames(const double *sliceNormal, double distance, double tolerance, std::vector<size_t> &frameIds);
+
+    // For every slice of the geometry, the ids of the frames located within the slice
+    //  (i.e., the frames whose position maps to a voxel of that slice)
+    std::vector<std::vector<size_t> > getSliceMap(const itk::ImageBase<3> *geometry);
+
+  private:
+    struct SortedFrame {
+      double distance;
+      size_t frameId;
+      bool operator<(const SortedFrame &other) const { return distance < other.distance; }
+      bool operator<(double other) const { return distance < other; }
+    };
+
+    void sortFrames(const double *sliceNormal);
+    void addFunctionalGroupFrames(DcmDataset *dataset, SourceFrame &frame);
+    static bool getPosition(DcmItem *item, double *position);
+
+    std::vector<SourceFrame> frames;
+    std::vector<SortedFrame> sortedFrames;
+    double sortNormal[3];
+  };
+
+}
+
+#endif //DCMQI_SOURCEIMAGEINDEX_H
@@ -0,0 +1,49 @@
+#ifndef DCMQI_WORKERPOOL_H
+#define DCMQI_WORKERPOOL_H
+
+// STD includes
+#include <cstddef>
+
+// ITK includes
+#include <itkMultiThreader.h>
+#include <itkSimpleFastMutexLock.h>
+
+namespace dcmqi {
+
+  // Unit of work executed by WorkerPool: process() is called exactly once for
+  //  every item, possibly concurrently from different threads
+  class WorkerTask {
+  public:
+    virtual ~WorkerTask() {}
+    virtual void process(size_t itemId) = 0;
+  };
+
+  class WorkerPool {
+
+  public:
+    // 0 requests the ITK default, which honors ITK_GLOBAL_DEFAULT_NUMBER_OF_THREADS
+    static unsigned getNumberOfThreads(unsigned requestedThreads);
+    // Same as above for the value of a command line option; negative values are
+    //  rejected with an error
+    static unsigned getNumberOfThreads(int requestedThreads);
+
+    // Processes items 0..numberOfItems-1 on up to numberOfThreads threads. Items are
+    //  handed out in increasing order as threads become available. Returns false if
+    //  processing of any of the items threw, in which case remaining items are skipped.
+    static bool run(WorkerTask &task, size_t numberOfItems, unsigned numberOfThreads);
+
+  private:
+    struct State {
+      WorkerTask *task;
+      size_t numberOfItems;
+      size_t nextItem;
+      bool failed;
+      itk::SimpleFastMutexLock lock;
+    };
+
+    static ITK_THREAD_RETURN_TYPE threadCallback(void *arg);
+  };
+
+}
+
+#endif //DCMQI_WORKERPOOL_H
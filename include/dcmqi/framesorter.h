@@ -34,6 +34,7 @@
 
 #include <stdlib.h>
 #include <math.h>
+#include <algorithm>
 
 /** Abstract class for sorting a set of frames in a functional group. The
  *  sorting criteria are up to the actual implementation classes.
@@ -69,7 +70,7 @@ public:
     /// The error code should be set in any case (default: EC_Normal)
     OFCondition errorCode;
     /// The frame numbers, in sorted order (default: empty)
-    OFVector<Uint16> frameNumbers;
+    OFVector<Uint32> frameNumbers;
     /// Tag key that contains the information that was crucial for sorting.
     /// This is especially useful for creating dimension indices. Should be
     /// set to (0xffff,0xfff) if none was used (default).
@@ -179,8 +180,13 @@ public:
       frameId()
     {}
 
-    Float32 key;
-    unsigned frameId;
+    bool operator<(const OrderedFrameItem &other) const
+    {
+      return key < other.key;
+    }
+
+    Float64 key;
+    Uint32 frameId;
   };
 
   FrameSorterIPP(){};
@@ -191,17 +197,37 @@ public:
     return "Returns frames in the order defined by projecting the ImagePositionPatient on the slice direction.";
   }
 
+  /** Get ImagePositionPatient of the frames read by the last call to sort(),
+   *  three values per frame, in the order of the frames in the functional group
+   *  @return The frame positions
+   */
+  const OFVector<Float64>& getFramePositions() const
+  {
+    return framePositions;
+  }
+
+  /** Get the sort keys (position projected on the slice direction) computed by
+   *  the last call to sort(), in the order of the frames in the functional group
+   *  @return The sort keys
+   */
+  const OFVector<Float64>& getFrameKeys() const
+  {
+    return frameKeys;
+  }
+
   void getSliceDirection(Results &results)
   {
+    // the orientation of the first frame is used whether it is shared or per-frame,
+    // same as when the image directions are read
     OFBool isPerFrame;
     FGPlaneOrientationPatient *planorfg = OFstatic_cast(FGPlaneOrientationPatient*,
                                                         m_fg->get(0, DcmFGTypes::EFG_PLANEORIENTPATIENT, isPerFrame));
-    if(!planorfg || isPerFrame){
+    if(!planorfg){
       results.errorCode = FG_EC_InvalidData;
       return;
     }
 
-    OFVector<Float32> dirX, dirY;
+    OFVector<Float64> dirX, dirY;
     OFString orientStr;
     for(int i=0;i<3;i++){
       if(planorfg->getImageOrientationPatient(orientStr, i).good()){
@@ -229,6 +255,9 @@ public:
 
   void sort(Results& results)
   {
+    framePositions.clear();
+    frameKeys.clear();
+
     if(m_fg == NULL){
       results.errorCode = FG_EC_InvalidData;
       return;
@@ -240,10 +269,12 @@ public:
     }
 
     OFBool isPerFrame;
-    size_t numFrames = m_fg->getNumberOfFrames();
-    OrderedFrameItem* orderedFrameItems = new OrderedFrameItem[numFrames];
+    const size_t numFrames = m_fg->getNumberOfFrames();
+    OFVector<OrderedFrameItem> orderedFrameItems(numFrames);
+    framePositions.resize(3*numFrames);
+    frameKeys.resize(numFrames);
 
-    for(int frameId=0;frameId<numFrames;frameId++)
+    for(size_t frameId=0;frameId<numFrames;frameId++)
     {
       FGPlanePosPatient *planposfg =
         OFstatic_cast(FGPlanePosPatient*,m_fg->get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
@@ -253,39 +284,35 @@ public:
         return;
       }
 
-      OFVector<Float32> sOrigin;
-      for(int j=0;j<3;j++){
-        OFString planposStr;
-        if(planposfg->getImagePositionPatient(planposStr, j).good()){
-          sOrigin.push_back(atof(planposStr.c_str()));
-        } else {
-          results.errorCode = FG_EC_InvalidData;
-          return;
-        }
+      Float64 *sOrigin = &framePositions[3*frameId];
+      if(planposfg->getImagePositionPatient(sOrigin[0], sOrigin[1], sOrigin[2]).bad()){
+        results.errorCode = FG_EC_InvalidData;
+        return;
       }
 
-      Float32 dist;
-      dist = dot(sliceDirection, sOrigin);
-      orderedFrameItems[frameId].key = dist;
-      orderedFrameItems[frameId].frameId = frameId;
+      frameKeys[frameId] = dot(sliceDirection, sOrigin);
+      orderedFrameItems[frameId].key = frameKeys[frameId];
+      orderedFrameItems[frameId].frameId = Uint32(frameId);
     }
 
-    qsort(&orderedFrameItems[0], numFrames, sizeof(OrderedFrameItem), &compareIPPKeys);
+    // frames at the same position keep the order of the functional group
+    std::stable_sort(orderedFrameItems.begin(), orderedFrameItems.end());
 
-    for(Uint32 count=0;count<numFrames;count++)
+    results.frameNumbers.reserve(numFrames);
+    for(size_t count=0;count<numFrames;count++)
     {
       results.frameNumbers.push_back(orderedFrameItems[count].frameId);
     }
-
-    delete [] orderedFrameItems;
+    results.key = DCM_ImagePositionPatient;
+    results.fgSequenceKey = DCM_PlanePositionSequence;
 
     return;
   }
 
 private:
 
-  OFVector<Float32> cross_3d(OFVector<Float32> v1, OFVector<Float32> v2){
-    OFVector<Float32> result;
+  OFVector<Float64> cross_3d(const OFVector<Float64> &v1, const OFVector<Float64> &v2){
+    OFVector<Float64> result;
     result.push_back(v1[1]*v2[2]-v1[2]*v2[1]);
     result.push_back(v1[2]*v2[0]-v1[0]*v2[2]);
     result.push_back(v1[0]*v2[1]-v1[1]*v2[0]);
@@ -293,32 +320,21 @@ private:
     return result;
   }
 
-  Float32 dot(OFVector<Float32> v1, OFVector<Float32> v2){
-    return Float32(v1[0]*v2[0]+v1[1]*v2[1]+v1[2]*v2[2]);
+  Float64 dot(const OFVector<Float64> &v1, const Float64 *v2){
+    return v1[0]*v2[0]+v1[1]*v2[1]+v1[2]*v2[2];
   }
 
-  void normalize(OFVector<Float32> &v){
+  void normalize(OFVector<Float64> &v){
     double norm = sqrt(v[0]*v[0]+v[1]*v[1]+v[2]*v[2]);
     v[0] = v[0]/norm;
     v[1] = v[1]/norm;
     v[2] = v[2]/norm;
   }
 
-  static int compareIPPKeys(const void *a, const void *b);
-
-  OFVector<Float32> sliceDirection;
+  OFVector<Float64> sliceDirection;
+  OFVector<Float64> framePositions;
+  OFVector<Float64> frameKeys;
 
 };
 
-int FrameSorterIPP::compareIPPKeys(const void *a, const void *b)
-{
-  FrameSorterIPP::OrderedFrameItem *i1, *i2;
-  i1 = (FrameSorterIPP::OrderedFrameItem*) a;
-  i2 = (FrameSorterIPP::OrderedFrameItem*) b;
-  if(i1->key > i2->key)
-    return 1;
-  else
-    return -1;
-}
-
 #endif // FRAMESORTHER_H
@@ -1,6 +1,7 @@
 
 // DCMQI includes
 #include "dcmqi/ConverterBase.h"
+#include "dcmqi/framesorter.h"
 
 
 namespace dcmqi {
@@ -38,4 +39,135 @@ namespace dcmqi {
     }
     return ident;
   }
+
+  int ConverterBase::computeFrameGeometry(FGInterface &fgInterface, FrameGeometry &frameGeometry) {
+    // positions closer than this along the slice direction belong to the same slice
+    const double tolerance = 1e-3;
+
+    const size_t numFrames = fgInterface.getNumberOfFrames();
+    frameGeometry.sliceDistances.clear();
+    frameGeometry.sliceSpacing = 0;
+    frameGeometry.sliceExtent = 0;
+
+    // the sorter reads the position of every frame once, and orders the frames
+    //  along the slice direction
+    FrameSorterIPP frameSorter;
+    FrameSorter::Results sortResults;
+    frameSorter.setSorterInput(&fgInterface);
+    frameSorter.sort(sortResults);
+    if(sortResults.errorCode.bad()){
+      cerr << "PlanePositionPatient is required for each frame, and PlaneOrientationPatient at least for the first frame!" << endl;
+      return EXIT_FAILURE;
+    }
+
+    const OFVector<Float64> &framePositions = frameSorter.getFramePositions();
+    const OFVector<Float64> &frameKeys = frameSorter.getFrameKeys();
+    frameGeometry.framePositions.assign(framePositions.begin(), framePositions.end());
+    frameGeometry.frameDistances.assign(frameKeys.begin(), frameKeys.end());
+    frameGeometry.sortedFrames.assign(sortResults.frameNumbers.begin(), sortResults.frameNumbers.end());
+
+    if(!numFrames)
+      return 0;
+
+    const vector<Uint32> &sortedFrames = frameGeometry.sortedFrames;
+    for(int j=0;j<3;j++)
+      frameGeometry.origin[j] = frameGeometry.framePositions[3*sortedFrames[0]+j];
+
+    // collapse the sorted positions into slices, and keep track (just out of curiousity)
+    //  how many slices have more than one frame
+    unsigned overlappingFramesCnt = 0;
+    size_t framesInSlice = 1;
+    frameGeometry.sliceDistances.push_back(frameGeometry.frameDistances[sortedFrames[0]]);
+    for(size_t i=1;i<numFrames;i++){
+      const double distance = frameGeometry.frameDistances[sortedFrames[i]];
+      if(distance-frameGeometry.sliceDistances.back() > tolerance){
+        if(framesInSlice>1)
+          overlappingFramesCnt++;
+        frameGeometry.sliceDistances.push_back(distance);
+        framesInSlice = 1;
+      } else {
+        framesInSlice++;
+      }
+    }
+    if(framesInSlice>1)
+      overlappingFramesCnt++;
+
+    // it IS possible to have a segmentation object containing just one frame!
+    const vector<double> &sliceDistances = frameGeometry.sliceDistances;
+    if(sliceDistances.size()>1){
+      // WARNING: this should be improved further. Spacing should be calculated for
+      //  consecutive frames of the individual segment. Right now, all frames are considered
+      //  indiscriminately. Question is whether it should be computed at all, considering we do
+      //  not have any information about whether the 2 frames are adjacent or not, so perhaps we should
+      //  always rely on the declared spacing, and not even try to compute it?
+      // TODO: discuss this with the QIICR team!
+      frameGeometry.sliceSpacing = sliceDistances[1]-sliceDistances[0];
+      frameGeometry.sliceExtent = sliceDistances.back()-sliceDistances[0];
+
+      // gaps that are not a multiple of the spacing cannot be represented on a regular grid
+      double minGap = frameGeometry.sliceSpacing, maxGap = minGap;
+      unsigned irregularGapsCnt = 0;
+      for(size_t i=1;i<sliceDistances.size();i++){
+        const double gap = sliceDistances[i]-sliceDistances[i-1];
+        minGap = min(minGap, gap);
+        maxGap = max(maxGap, gap);
+        const double steps = gap/frameGeometry.sliceSpacing;
+        if(fabs(steps-floor(steps+0.5))*frameGeometry.sliceSpacing > tolerance)
+          irregularGapsCnt++;
+      }
+      if(irregularGapsCnt)
+        cerr << "WARNING: " << irregularGapsCnt << " gap(s) between slices are not a multiple of the slice spacing " <<
+        frameGeometry.sliceSpacing << " (smallest gap " << minGap << ", largest gap " << maxGap << ")" << endl;
+    }
+
+    cout << "Total frames: " << numFrames << endl;
+    cout << "Total frames with unique IPP: " << sliceDistances.size() << endl;
+    cout << "Total overlapping frames: " << overlappingFramesCnt << endl;
+    cout << "Origin: " << frameGeometry.origin[0] << " " << frameGeometry.origin[1] << " " <<
+    frameGeometry.origin[2] << endl;
+
+    return 0;
+  }
+
+  vector<unsigned> ConverterBase::getFrameSlices(const FrameGeometry &frameGeometry, const itk::ImageBase<3> *image) {
+    // frames that are further than this from a slice of the image are reported
+    const double tolerance = 1e-3;
+
+    // each frame is placed at the slice nearest to its position, same as rounding
+    //  the continuous index of the frame origin in the image
+    const size_t numFrames = frameGeometry.frameDistances.size();
+    const itk::ImageBase<3>::SizeType imageSize = image->GetLargestPossibleRegion().GetSize();
+    const itk::ImageBase<3>::SpacingType imageSpacing = image->GetSpacing();
+    vector<unsigned> frameSlices(numFrames, 0);
+    unsigned offGridFramesCnt = 0;
+    for(size_t frameId=0;frameId<numFrames;frameId++){
+      itk::Point<double, 3> frameOriginPoint;
+      for(int j=0;j<3;j++)
+        frameOriginPoint[j] = frameGeometry.framePositions[3*frameId+j];
+
+      itk::ContinuousIndex<double, 3> frameOriginIndex;
+      image->TransformPhysicalPointToContinuousIndex(frameOriginPoint, frameOriginIndex);
+      const double slice = floor(frameOriginIndex[2]+0.5);
+
+      // the frame covers the whole plane of the image, so its origin must be at
+      //  the first row and column
+      if(fabs(frameOriginIndex[0]) >= 0.5 || fabs(frameOriginIndex[1]) >= 0.5
+         || slice < 0 || slice >= imageSize[2]){
+        cerr << "ERROR: Frame " << frameId << " origin " << frameOriginPoint <<
+        " is outside image geometry!" << frameOriginIndex << endl;
+        cerr << "Image size: " << imageSize << endl;
+        throw -1;
+      }
+
+      if(fabs(frameOriginIndex[0])*imageSpacing[0] > tolerance || fabs(frameOriginIndex[1])*imageSpacing[1] > tolerance
+         || fabs(frameOriginIndex[2]-slice)*imageSpacing[2] > tolerance)
+        offGridFramesCnt++;
+      frameSlices[frameId] = unsigned(slice);
+    }
+    if(offGridFramesCnt)
+      cerr << "WARNING: " << offGridFramesCnt << " frame(s) are not aligned with the image grid, " <<
+      "each of them is placed at the nearest slice" << endl;
+
+    return frameSlices;
+  }
 }
@@ -0,0 +1,246 @@
+// DCMQI includes
+#include "dcmqi/DicomDirectoryScanner.h"
+#include "dcmqi/Helper.h"
+#include "dcmqi/WorkerPool.h"
+
+// DCMTK includes
+#include <dcmtk/dcmdata/dcfilefo.h>
+#include <dcmtk/dcmdata/dcmetinf.h>
+#include <dcmtk/dcmdata/dcuid.h>
+#include <dcmtk/ofstd/ofstd.h>
+
+// STD includes
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+
+namespace dcmqi {
+
+  // Gets the size and modification time of a file, returns false if the file cannot
+  //  be accessed
+  static bool getFileStatus(const std::string &path, Json::UInt64 &modificationTime, Json::UInt64 &size) {
+#ifdef _WIN32
+    struct _stat64 fileStat;
+    if(_stat64(path.c_str(), &fileStat) != 0)
+      return false;
+#else
+    struct stat fileStat;
+    if(stat(path.c_str(), &fileStat) != 0)
+      return false;
+#endif
+    modificationTime = Json::UInt64(fileStat.st_mtime);
+    size = Json::UInt64(fileStat.st_size);
+    return true;
+  }
+
+  // Classifies the files that were not found in the index; the messages are kept
+  //  per file, and printed in the order of the files once all of them are classified
+  class DicomDirectoryScanner::ClassifyTask : public WorkerTask {
+  public:
+    ClassifyTask(std::vector<FileInfo> &files, const std::vector<size_t> &fileIds)
+        : messages(fileIds.size()), files(files), fileIds(fileIds) {}
+
+    void process(size_t itemId) {
+      classifyFile(files[fileIds[itemId]], messages[itemId]);
+    }
+
+    std::vector<std::string> messages;
+
+  private:
+    std::vector<FileInfo> &files;
+    const std::vector<size_t> &fileIds;
+  };
+
+  void DicomDirectoryScanner::scan(const std::string &directory, const std::string &indexFileName,
+                                   unsigned numberOfThreads) {
+    std::map<std::string, FileInfo> index;
+    if(!indexFileName.empty() && OFStandard::fileExists(indexFileName.c_str()) && !readIndex(indexFileName, index))
+      std::cerr << "WARNING: Failed to read the DICOM index " << indexFileName << ", ignoring it" << std::endl;
+
+    std::vector<std::string> fileList = Helper::getFileListRecursively(directory);
+    files.clear();
+    files.resize(fileList.size());
+
+    std::vector<size_t> newFileIds;
+    for(size_t i=0;i<fileList.size();i++){
+      FileInfo &info = files[i];
+      info.path = fileList[i];
+      getFileStatus(info.path, info.modificationTime, info.size);
+      std::map<std::string, FileInfo>::const_iterator indexed = index.find(info.path);
+      if(indexed != index.end() && indexed->second.modificationTime == info.modificationTime &&
+         indexed->second.size == info.size)
+        info = indexed->second;
+      else
+        newFileIds.push_back(i);
+    }
+    if(!indexFileName.empty())
+      std::cout << fileList.size()-newFileIds.size() << " of " << fileList.size() << " files found in the DICOM index"
+                << std::endl;
+
+    ClassifyTask classifyTask(files, newFileIds);
+    if(!WorkerPool::run(classifyTask, newFileIds.size(), WorkerPool::getNumberOfThreads(numberOfThreads)))
+      std::cerr << "WARNING: Failed to classify some of the files in " << directory << std::endl;
+    for(size_t i=0;i<classifyTask.messages.size();i++)
+      if(!classifyTask.messages[i].empty())
+        std::cout << classifyTask.messages[i] << std::endl;
+
+    if(!indexFileName.empty() && !writeIndex(indexFileName))
+      std::cerr << "WARNING: Failed to write the DICOM index " << indexFileName << std::endl;
+  }
+
+  bool DicomDirectoryScanner::getMatchingFiles(const itk::ImageBase<3> *geometry,
+                                               std::vector<std::string> &matchingFiles) const {
+    // number of instances of each series positioned within the geometry
+    std::map<std::string, size_t> seriesInstancesInGeometry;
+    for(size_t i=0;i<files.size();i++){
+      if(!files[i].isDicom)
+        continue;
+      size_t &instancesInGeometry = seriesInstancesInGeometry[files[i].seriesInstanceUID];
+      if(!files[i].hasPosition)
+        continue;
+      itk::Point<double, 3> ippPoint;
+      itk::ImageBase<3>::IndexType ippIndex;
+      for(int j=0;j<3;j++)
+        ippPoint[j] = files[i].position[j];
+      if(geometry->TransformPhysicalPointToIndex(ippPoint, ippIndex))
+        instancesInGeometry++;
+    }
+
+    // the series with the most instances within the geometry is the source; a series
+    //  that only touches the geometry (e.g., a localizer) is not selected
+    std::string matchingSeries;
+    std::vector<std::string> ambiguousSeries;
+    size_t maxInstancesInGeometry = 0;
+    for(std::map<std::string, size_t>::const_iterator sI=seriesInstancesInGeometry.begin();
+        sI!=seriesInstancesInGeometry.end();++sI){
+      if(!sI->second || sI->second < maxInstancesInGeometry)
+        continue;
+      if(sI->second > maxInstancesInGeometry)
+        ambiguousSeries.clear();
+      ambiguousSeries.push_back(sI->first);
+      matchingSeries = sI->first;
+      maxInstancesInGeometry = sI->second;
+    }
+    if(ambiguousSeries.size() > 1){
+      std::cerr << "ERROR: " << ambiguousSeries.size() << " series have " << maxInstancesInGeometry <<
+      " instances within the image geometry, cannot select the source series:" << std::endl;
+      for(size_t i=0;i<ambiguousSeries.size();i++)
+        std::cerr << "  SeriesInstanceUID " << ambiguousSeries[i] << std::endl;
+      return false;
+    }
+
+    matchingFiles.clear();
+    for(size_t i=0;i<files.size();i++){
+      if(files[i].isDicom && (matchingSeries.empty() || files[i].seriesInstanceUID == matchingSeries))
+        matchingFiles.push_back(files[i].path);
+    }
+    if(matchingSeries.empty())
+      std::cout << "No series matches the image geometry, using all " << matchingFiles.size() << " DICOM files"
+                << std::endl;
+    else
+      std::cout << "Series " << matchingSeries << " (" << matchingFiles.size() << " files) of " <<
+      seriesInstancesInGeometry.size() << " series matches the image geometry" << std::endl;
+    return true;
+  }
+
+  void DicomDirectoryScanner::classifyFile(FileInfo &info, std::string &message) {
+    info.isDicom = false;
+    info.hasPosition = false;
+
+    FILE *file = fopen(info.path.c_str(), "rb");
+    if(!file)
+      return;
+    char magic[DCM_MagicLen];
+    bool hasMagic = fseek(file, DCM_PreambleLen, SEEK_SET) == 0 &&
+        fread(magic, 1, DCM_MagicLen, file) == DCM_MagicLen && memcmp(magic, DCM_Magic, DCM_MagicLen) == 0;
+    fclose(file);
+
+    // the meta header and the dataset up to ImagePositionPatient are enough to
+    //  identify the instance, its series and its position; files without the DICM
+    //  prefix (e.g., a bare dataset) are parsed as well, and reported if they turn
+    //  out not to be DICOM
+    DcmFileFormat fileFormat;
+    if(fileFormat.loadFileUntilTag(info.path.c_str(), EXS_Unknown, EGL_noChange, DCM_MaxReadLength,
+                                   hasMagic ? ERM_fileOnly : ERM_autoDetect, DcmTagKey(0x0020, 0x0033)).bad()){
+      if(!hasMagic)
+        message = "Skipping " + info.path + ": not a DICOM file";
+      return;
+    }
+
+    OFString value;
+    if(fileFormat.getMetaInfo()->findAndGetOFString(DCM_MediaStorageSOPClassUID, value).good() &&
+       value == UID_MediaStorageDirectoryStorage)
+      return;
+    info.isDicom = true;
+
+    DcmDataset *dataset = fileFormat.getDataset();
+    if(dataset->findAndGetOFString(DCM_SOPInstanceUID, value).good() ||
+       fileFormat.getMetaInfo()->findAndGetOFString(DCM_MediaStorageSOPInstanceUID, value).good())
+      info.sopInstanceUID = value.c_str();
+    if(dataset->findAndGetOFString(DCM_SeriesInstanceUID, value).good())
+      info.seriesInstanceUID = value.c_str();
+    info.hasPosition = true;
+    for(int j=0;j<3;j++)
+      info.hasPosition = info.hasPosition &&
+          dataset->findAndGetFloat64(DCM_ImagePositionPatient, info.position[j], j).good();
+  }
+
+  bool DicomDirectoryScanner::readIndex(const std::string &indexFileName, std::map<std::string, FileInfo> &index) {
+    std::ifstream indexStream(indexFileName.c_str(), std::ios_base::binary);
+    Json::Value root;
+    Json::Reader reader;
+    if(!indexStream || !reader.parse(indexStream, root) || !root.isObject() || !root["files"].isArray())
+      return false;
+
+    const Json::Value &entries = root["files"];
+    for(Json::ArrayIndex i=0;i<entries.size();i++){
+      const Json::Value &entry = entries[i];
+      FileInfo info;
+      info.path = entry.get("path", "").asString();
+      info.modificationTime = entry.get("modificationTime", 0).asUInt64();
+      info.size = entry.get("size", 0).asUInt64();
+      info.isDicom = entry.get("isDicom", false).asBool();
+      info.seriesInstanceUID = entry.get("SeriesInstanceUID", "").asString();
+      info.sopInstanceUID = entry.get("SOPInstanceUID", "").asString();
+      const Json::Value &position = entry["ImagePositionPatient"];
+      info.hasPosition = position.isArray() && position.size() == 3;
+      for(Json::ArrayIndex j=0;info.hasPosition && j<3;j++)
+        info.position[j] = position[j].asDouble();
+      if(!info.path.empty())
+        index[info.path] = info;
+    }
+    return true;
+  }
+
+  bool DicomDirectoryScanner::writeIndex(const std::string &indexFileName) const {
+    Json::Value root(Json::objectValue);
+    Json::Value &entries = root["files"] = Json::Value(Json::arrayValue);
+    for(size_t i=0;i<files.size();i++){
+      const FileInfo &info = files[i];
+      Json::Value entry(Json::objectValue);
+      entry["path"] = info.path;
+      entry["modificationTime"] = info.modificationTime;
+      entry["size"] = info.size;
+      entry["isDicom"] = info.isDicom;
+      if(info.isDicom){
+        entry["SeriesInstanceUID"] = info.seriesInstanceUID;
+        entry["SOPInstanceUID"] = info.sopInstanceUID;
+        if(info.hasPosition){
+          Json::Value &position = entry["ImagePositionPatient"] = Json::Value(Json::arrayValue);
+          for(int j=0;j<3;j++)
+            position.append(info.position[j]);
+        }
+      }
+      entries.append(entry);
+    }
+
+    std::ofstream indexStream(indexFileName.c_str(), std::ios_base::binary);
+    Json::FastWriter writer;
+    indexStream << writer.write(root);
+    return indexStream.good();
+  }
+
+}
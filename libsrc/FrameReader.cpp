@@ -0,0 +1,74 @@
+// DCMQI includes
+#include "dcmqi/FrameReader.h"
+
+// DCMTK includes
+#include <dcmtk/dcmdata/dcxfer.h>
+
+// STD includes
+#include <algorithm>
+
+
+namespace dcmqi {
+
+  FrameReader::FrameReader(DcmDataset *dataset, const DcmTagKey &pixelDataTag)
+      : dataset(dataset), pixelDataTag(pixelDataTag), pixelData(NULL) {
+  }
+
+  FrameReader::~FrameReader() {
+    attach();
+  }
+
+  bool FrameReader::detach() {
+    if(pixelData)
+      return true;
+
+    DcmXfer xfer(dataset->getOriginalXfer());
+    if(xfer.isEncapsulated() || xfer.getStreamCompression() != ESC_none)
+      return false;
+
+    DcmElement *element = NULL;
+    if(dataset->findAndGetElement(pixelDataTag, element).bad() || !element ||
+       element->getLengthField() == DCM_UndefinedLength)
+      return false;
+
+    pixelData = dataset->remove(element);
+    return pixelData != NULL;
+  }
+
+  void FrameReader::attach() {
+    if(!pixelData)
+      return;
+    dataset->insert(pixelData, OFTrue);
+    pixelData = NULL;
+  }
+
+  bool FrameReader::readFrame(size_t frameId, size_t bitsPerFrame, Uint8 *buffer, E_ByteOrder byteOrder) {
+    if(!pixelData)
+      return false;
+
+    const size_t firstBit = frameId*bitsPerFrame;
+    const size_t offset = firstBit >> 3;
+    const unsigned shift = unsigned(firstBit & 7);
+    const size_t frameBytes = (bitsPerFrame+7) >> 3;
+    const size_t elementLength = pixelData->getLengthField();
+    if(offset >= elementLength)
+      return false;
+
+    // the last frame of a bit-packed element may end within the last byte
+    const size_t numBytes = std::min(size_t((shift+bitsPerFrame+7) >> 3), elementLength-offset);
+    if(numBytes < frameBytes)
+      return false;
+
+    if(!shift)
+      return pixelData->getPartialValue(buffer, Uint32(offset), Uint32(frameBytes), &fileCache, byteOrder).good();
+
+    readBuffer.resize(frameBytes+1);
+    readBuffer[frameBytes] = 0;
+    if(pixelData->getPartialValue(&readBuffer[0], Uint32(offset), Uint32(numBytes), &fileCache, byteOrder).bad())
+      return false;
+    for(size_t i=0;i<frameBytes;i++)
+      buffer[i] = Uint8((readBuffer[i] >> shift) | (readBuffer[i+1] << (8-shift)));
+    return true;
+  }
+
+}
@@ -1,12 +1,33 @@
 
 // DCMQI includes
 #include "dcmqi/Helper.h"
+#include "dcmqi/WorkerPool.h"
 
 // DCMTK includes
 #include <dcmtk/ofstd/oflist.h>
 
+// STD includes
+#include <cmath>
+
 namespace dcmqi {
 
+  // Loads the header of one file into its slot of the result
+  class Helper::HeaderLoadTask : public WorkerTask {
+  public:
+    HeaderLoadTask(const vector<string> &fileNames, vector<DcmDataset*> &datasets)
+        : fileNames(fileNames), datasets(datasets) {}
+
+    void process(size_t itemId) {
+      DcmFileFormat fileFormat;
+      if(loadHeader(fileFormat, fileNames[itemId]).good())
+        datasets[itemId] = fileFormat.getAndRemoveDataset();
+    }
+
+  private:
+    const vector<string> &fileNames;
+    vector<DcmDataset*> &datasets;
+  };
+
   bool Helper::isUndefinedOrPathDoesNotExist(const string &var, const string &humanReadableName) {
     return Helper::isUndefined(var, humanReadableName) || !Helper::pathExists(var);
   }
@@ -67,45 +88,174 @@ namespace dcmqi {
     return dicomImageFiles;
   }
 
-  vector<DcmDataset*> Helper::loadDatasets(const vector<string>& dicomImageFiles) {
+  vector<DcmDataset*> Helper::loadHeaders(const vector<string>& dicomImageFiles, unsigned numberOfThreads) {
+    vector<DcmDataset*> datasets(dicomImageFiles.size(), static_cast<DcmDataset*>(NULL));
+    HeaderLoadTask loadTask(dicomImageFiles, datasets);
+    if(!WorkerPool::run(loadTask, dicomImageFiles.size(), WorkerPool::getNumberOfThreads(numberOfThreads))){
+      cerr << "ERROR: Failed to load source DICOM files!" << endl;
+      for(size_t i=0;i<datasets.size();i++)
+        delete datasets[i];
+      throw -1;
+    }
+    return datasets;
+  }
+
+  vector<DcmDataset*> Helper::loadDatasets(const vector<string>& dicomImageFiles, unsigned numberOfThreads,
+                                           DatasetLoadSummary *summary) {
+    // parse the files concurrently, then check them one by one in the input order,
+    //  so that both the result and the messages do not depend on the scheduling
+    vector<DcmDataset*> loadedDatasets = loadHeaders(dicomImageFiles, numberOfThreads);
+
     vector<DcmDataset*> dcmDatasets;
-    OFString tmp, sopInstanceUID;
-    DcmFileFormat* sliceFF = new DcmFileFormat();
+    DatasetLoadSummary loadSummary;
+    // UIDs of the accepted datasets, to drop duplicates without looking them up again
+    set<OFString> sopInstanceUIDs;
+    OFString sopInstanceUID;
     for(size_t dcmFileNumber=0; dcmFileNumber<dicomImageFiles.size(); dcmFileNumber++){
-      if(sliceFF->loadFile(dicomImageFiles[dcmFileNumber].c_str()).good()){
-        DcmDataset* currentDataset = sliceFF->getAndRemoveDataset();
+      if(loadedDatasets[dcmFileNumber]){
+        DcmDataset* currentDataset = loadedDatasets[dcmFileNumber];
         if(!currentDataset->tagExistsWithValue(DCM_PixelData)){
           std::cerr << "Source DICOM file does not contain PixelData, skipping: " << std::endl
              << "  >>>   " << dicomImageFiles[dcmFileNumber] << std::endl;
+          delete currentDataset;
+          loadSummary.noPixelData++;
           continue;
         };
         currentDataset->findAndGetOFString(DCM_SOPInstanceUID, sopInstanceUID);
-        bool exists = false;
-        for(size_t i=0;i<dcmDatasets.size();i++) {
-          dcmDatasets[i]->findAndGetOFString(DCM_SOPInstanceUID, tmp);
-          if (tmp == sopInstanceUID) {
-            cout << dicomImageFiles[dcmFileNumber].c_str() << " with SOPInstanceUID: " << sopInstanceUID
-                 << " already exists" << endl;
-            exists = true;
-            break;
-          }
-        }
-        if (!exists) {
+        if (sopInstanceUIDs.insert(sopInstanceUID).second) {
           dcmDatasets.push_back(currentDataset);
+        } else {
+          delete currentDataset;
+          loadSummary.duplicates++;
         }
       } else {
         cerr << "Failed to read " << dicomImageFiles[dcmFileNumber] << ". Skipping it." << endl;
+        loadSummary.failed++;
       }
     }
-    delete sliceFF;
+
+    cout << "Loaded " << dcmDatasets.size() << " of " << dicomImageFiles.size() << " source DICOM file(s)";
+    if(dcmDatasets.size() != dicomImageFiles.size())
+      cout << ", skipped " << loadSummary.duplicates << " with duplicate SOPInstanceUID, " <<
+      loadSummary.noPixelData << " without PixelData, " << loadSummary.failed << " unreadable";
+    cout << endl;
+
+    if(summary)
+      *summary = loadSummary;
     return dcmDatasets;
   }
 
 
-  string Helper::floatToStrScientific(float f) {
-    ostringstream sstream;
-    sstream << scientific << f;
-    return sstream.str();
+  OFCondition Helper::loadHeader(DcmFileFormat &fileFormat, const string &fileName) {
+    // Parsing stops at the first element following PixelData, and the PixelData value
+    //  itself is left in the file (it is longer than the read limit), so only the
+    //  element header is read. This is enough to check that PixelData is present.
+    return fileFormat.loadFileUntilTag(fileName.c_str(), EXS_Unknown, EGL_noChange,
+                                       DCM_MaxReadLength, ERM_autoDetect, DcmTagKey(0x7fe0, 0x0011));
+  }
+
+  // Scales value by 10^exponent; the powers that are exactly representable keep the
+  //  result correctly rounded
+  static double scaleByPowerOfTen(double value, int exponent) {
+    static const double powersOfTen[] = {
+      1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10, 1e11,
+      1e12, 1e13, 1e14, 1e15, 1e16, 1e17, 1e18, 1e19, 1e20, 1e21, 1e22
+    };
+    while(exponent > 22){
+      value *= powersOfTen[22];
+      exponent -= 22;
+    }
+    while(exponent < -22){
+      value /= powersOfTen[22];
+      exponent += 22;
+    }
+    return exponent < 0 ? value/powersOfTen[-exponent] : value*powersOfTen[exponent];
+  }
+
+  char* Helper::floatToDecimalString(float f, char *buffer) {
+    char *out = buffer;
+    // DS has no representation for NaN or infinity
+    if(f != f || f-f != 0 || f == 0){
+      *out++ = '0';
+      *out = 0;
+      return buffer;
+    }
+    if(f < 0)
+      *out++ = '-';
+    const double value = fabs(double(f));
+
+    // decimal exponent of the leading digit, and the value scaled to 9 significant
+    //  digits, which is enough for any float to be parsed back to the same value
+    int exponent = int(floor(log10(value)));
+    double scaled = scaleByPowerOfTen(value, 8-exponent);
+    if(scaled >= 1e9){
+      exponent++;
+      scaled = scaleByPowerOfTen(value, 8-exponent);
+    } else if(scaled < 1e8){
+      exponent--;
+      scaled = scaleByPowerOfTen(value, 8-exponent);
+    }
+
+    // use the shortest number of digits that still parses back to f
+    unsigned digits = 0;
+    int numberOfDigits = 1, digitsExponent = exponent;
+    for(;numberOfDigits<=9;numberOfDigits++){
+      digits = unsigned(floor(scaleByPowerOfTen(scaled, numberOfDigits-9)+0.5));
+      digitsExponent = exponent;
+      if(digits == unsigned(scaleByPowerOfTen(1, numberOfDigits))){
+        // rounding carried into a new leading digit
+        digits /= 10;
+        digitsExponent++;
+      }
+      if(numberOfDigits == 9 ||
+         float(scaleByPowerOfTen(digits, digitsExponent-numberOfDigits+1)) == float(value))
+        break;
+    }
+    exponent = digitsExponent;
+    while(numberOfDigits > 1 && digits%10 == 0){
+      digits /= 10;
+      numberOfDigits--;
+    }
+
+    char digitChars[9];
+    for(int i=numberOfDigits-1;i>=0;i--){
+      digitChars[i] = char('0'+digits%10);
+      digits /= 10;
+    }
+
+    // fixed notation as long as it fits in the 16 characters of DS, which is the case
+    //  for the positions and spacings of any practical image
+    if(exponent >= 0 && exponent <= 8){
+      for(int i=0;i<numberOfDigits || i<=exponent;i++){
+        if(i == exponent+1)
+          *out++ = '.';
+        *out++ = i < numberOfDigits ? digitChars[i] : '0';
+      }
+    } else if(exponent < 0 && exponent >= -5){
+      *out++ = '0';
+      *out++ = '.';
+      for(int i=-1;i>exponent;i--)
+        *out++ = '0';
+      for(int i=0;i<numberOfDigits;i++)
+        *out++ = digitChars[i];
+    } else {
+      *out++ = digitChars[0];
+      if(numberOfDigits > 1){
+        *out++ = '.';
+        for(int i=1;i<numberOfDigits;i++)
+          *out++ = digitChars[i];
+      }
+      *out++ = 'e';
+      if(exponent < 0){
+        *out++ = '-';
+        exponent = -exponent;
+      }
+      if(exponent >= 10)
+        *out++ = char('0'+exponent/10);
+      *out++ = char('0'+exponent%10);
+    }
+    *out = 0;
+    return buffer;
   }
 
   void Helper::checkValidityOfFirstSrcImage(DcmSegmentation *segdoc) {
@@ -2,13 +2,357 @@
 // DCMQI includes
 #include "dcmqi/ImageSEGConverter.h"
 
+// STD includes
+#include <cstring>
+
 
 namespace dcmqi {
 
+  // Keeps all of the decoded segment images, for the map-returning variant of the decoder
+  class ImageSEGConverter::SegmentImageCollector : public SegmentImageVisitor {
+  public:
+    void visit(unsigned segmentNumber, ShortImageType::Pointer segmentImage) {
+      segment2image[segmentNumber] = segmentImage;
+    }
+
+    map<unsigned,ShortImageType::Pointer> segment2image;
+  };
+
+  // Scans a slab of slices of the label image
+  class ImageSEGConverter::LabelScanTask : public WorkerTask {
+  public:
+    LabelScanTask(const ShortImageType::Pointer &labelImage, unsigned slicesPerSlab,
+                  vector<map<short,LabelFrames> > &slabLabelFrames)
+        : labelImage(labelImage), slicesPerSlab(slicesPerSlab), slabLabelFrames(slabLabelFrames) {}
+
+    void process(size_t itemId) {
+      const unsigned numSlices = labelImage->GetBufferedRegion().GetSize()[2];
+      const unsigned firstSlice = unsigned(itemId)*slicesPerSlab;
+      scanLabelFrames(labelImage, firstSlice, min(firstSlice+slicesPerSlab, numSlices), slabLabelFrames[itemId]);
+    }
+
+  private:
+    const ShortImageType::Pointer &labelImage;
+    unsigned slicesPerSlab;
+    vector<map<short,LabelFrames> > &slabLabelFrames;
+  };
+
+  // Adds the frames to the segmentation document along with their per-frame functional
+  //  groups, and collects the source images referenced by the frames
+  class ImageSEGConverter::SegmentationFrameWriter {
+  public:
+    SegmentationFrameWriter(DcmSegmentation *segdoc, const vector<DcmDataset*> &dcmDatasets,
+                            const itk::ImageBase<3> *geometry)
+        : segdoc(segdoc), dcmDatasets(dcmDatasets),
+          slice2derimg(getSliceMapForSegmentation2DerivationImage(dcmDatasets, geometry, &slice2frameNumbers)),
+          sliceDerivations(slice2derimg.size(), static_cast<FGDerivationImage*>(NULL)),
+          sliceReferenced(slice2derimg.size(), 0),
+          fgppp(FGPlanePosPatient::createMinimal("1","1","1")),
+          refseriesItem(new IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem) {
+      bool hasDerivationImages = false;
+      for(vector<vector<int> >::const_iterator vI=slice2derimg.begin();vI!=slice2derimg.end();++vI)
+        if((*vI).size()>0)
+          hasDerivationImages = true;
+
+      perFrameFGs.push_back(fgppp);
+      perFrameFGs.push_back(&fgfc);
+      // the derivation image FG of the slice is put in place for every frame
+      if(hasDerivationImages)
+        perFrameFGs.push_back(NULL);
+
+      OFString seriesInstanceUID;
+      CHECK_COND(dcmDatasets[0]->findAndGetOFString(DCM_SeriesInstanceUID, seriesInstanceUID));
+      CHECK_COND(refseriesItem->setSeriesInstanceUID(seriesInstanceUID));
+    }
+
+    ~SegmentationFrameWriter() {
+      for(size_t i=0;i<sliceDerivations.size();i++)
+        delete sliceDerivations[i];
+      delete fgppp;
+      delete refseriesItem;
+    }
+
+    // Adds the frame of the given slice to the segment; dimensionIndex is the value of
+    //  the ImagePositionPatient dimension, slicePosition points to the 3 formatted
+    //  components of the position
+    void addFrame(Uint8 *frameData, Uint16 segmentNumber, unsigned sliceNumber, unsigned dimensionIndex,
+                  const char *slicePosition) {
+      // PerFrame FG: FrameContentSequence
+      //fracon->setStackID("1"); // all frames go into the same stack
+      CHECK_COND(fgfc.setDimensionIndexValues(segmentNumber, 0));
+      CHECK_COND(fgfc.setDimensionIndexValues(dimensionIndex, 1));
+
+      // PerFrame FG: PlanePositionSequence
+      CHECK_COND(fgppp->setImagePositionPatient(
+          slicePosition,
+          slicePosition+Helper::DecimalStringBufferSize,
+          slicePosition+2*Helper::DecimalStringBufferSize));
+
+      if(perFrameFGs.size() > 2){
+        perFrameFGs[2] = getSliceDerivation(sliceNumber);
+        sliceReferenced[sliceNumber] = 1;
+      }
+
+      CHECK_COND(segdoc->addFrame(frameData, segmentNumber, perFrameFGs));
+    }
+
+    // Adds the source images referenced by the frames to the common instance reference
+    //  module, unless no frame references any of them
+    void addCommonInstanceReference() {
+      set<int> datasetIds;
+      for(size_t slice=0;slice<slice2derimg.size();slice++)
+        if(sliceReferenced[slice])
+          datasetIds.insert(slice2derimg[slice].begin(), slice2derimg[slice].end());
+      addReferencedInstances(dcmDatasets, datasetIds, *refseriesItem);
+
+      if(refseriesItem->getReferencedInstanceItems().size()){
+        segdoc->getCommonInstanceReference().getReferencedSeriesItems().push_back(refseriesItem);
+        refseriesItem = NULL;
+      }
+    }
+
+  private:
+    // The derivation image FG of a slice is created when the first frame of the slice
+    //  is added, and shared by the frames of all segments at that slice
+    FGDerivationImage* getSliceDerivation(unsigned sliceNumber) {
+      if(sliceDerivations[sliceNumber])
+        return sliceDerivations[sliceNumber];
+
+      FGDerivationImage *fgder = new FGDerivationImage();
+      sliceDerivations[sliceNumber] = fgder;
+      if(slice2derimg[sliceNumber].empty())
+        return fgder;
+
+      OFVector<DcmDataset*> siVector;
+      for(size_t derImageInstanceNum=0;
+          derImageInstanceNum<slice2derimg[sliceNumber].size();
+          derImageInstanceNum++){
+        siVector.push_back(dcmDatasets[slice2derimg[sliceNumber][derImageInstanceNum]]);
+      }
+
+      DerivationImageItem *derimgItem;
+      CHECK_COND(fgder->addDerivationImageItem(CodeSequenceMacro("113076","DCM","Segmentation"),"",derimgItem));
+
+      OFVector<SourceImageItem*> srcimgItems;
+      CHECK_COND(derimgItem->addSourceImageItems(siVector,
+                                                 CodeSequenceMacro("121322","DCM","Source image for image processing operation"),
+                                                 srcimgItems));
+      setReferencedFrameNumbers(srcimgItems, slice2frameNumbers[sliceNumber]);
+      return fgder;
+    }
+
+    DcmSegmentation *segdoc;
+    const vector<DcmDataset*> &dcmDatasets;
+    // filled in when slice2derimg is initialized, hence declared first
+    vector<vector<OFVector<Uint16> > > slice2frameNumbers;
+    vector<vector<int> > slice2derimg;
+    vector<FGDerivationImage*> sliceDerivations;
+    vector<char> sliceReferenced;
+
+    FGPlanePosPatient *fgppp;
+    FGFrameContent fgfc;
+    OFVector<FGBase*> perFrameFGs;
+
+    IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem *refseriesItem;
+  };
+
+  // Formats ImagePositionPatient of a slice
+  class ImageSEGConverter::SlicePositionTask : public WorkerTask {
+  public:
+    SlicePositionTask(const itk::ImageBase<3> *image, vector<char> &slicePositions)
+        : image(image), slicePositions(slicePositions) {}
+
+    void process(size_t itemId) {
+      itk::ImageBase<3>::PointType sliceOriginPoint;
+      itk::ImageBase<3>::IndexType sliceOriginIndex;
+      sliceOriginIndex.Fill(0);
+      sliceOriginIndex[2] = itemId;
+      image->TransformIndexToPhysicalPoint(sliceOriginIndex, sliceOriginPoint);
+      for(int j=0;j<3;j++)
+        Helper::floatToDecimalString(sliceOriginPoint[j],
+                                     &slicePositions[(3*itemId+j)*Helper::DecimalStringBufferSize]);
+    }
+
+  private:
+    const itk::ImageBase<3> *image;
+    vector<char> &slicePositions;
+  };
+
+  // Unpacks the mask of a label for a single slice into the frame batch buffer
+  class ImageSEGConverter::FramePreparationTask : public WorkerTask {
+  public:
+    FramePreparationTask(const LabelFrames &labelFrames, const unsigned *batchSlices, size_t frameSize,
+                         vector<Uint8> &frameBatch)
+        : labelFrames(labelFrames), batchSlices(batchSlices), frameSize(frameSize), frameBatch(frameBatch) {}
+
+    void process(size_t itemId) {
+      Uint8 *frameData = &frameBatch[itemId*frameSize];
+      map<unsigned, vector<Uint8> >::const_iterator packedFrame = labelFrames.slices.find(batchSlices[itemId]);
+      if(packedFrame != labelFrames.slices.end())
+        unpackLabelFrame(&packedFrame->second[0], frameData, frameSize);
+      else
+        memset(frameData, 0, frameSize);
+    }
+
+  private:
+    const LabelFrames &labelFrames;
+    const unsigned *batchSlices;
+    size_t frameSize;
+    vector<Uint8> &frameBatch;
+  };
+
+  // Finds the largest fractional value of a slice
+  template<class TImage>
+  class ImageSEGConverter::FractionalScanTask : public WorkerTask {
+  public:
+    FractionalScanTask(const TImage *image, Uint8 maximumFractionalValue, vector<Uint8> &sliceMaxima)
+        : image(image), maximumFractionalValue(maximumFractionalValue), sliceMaxima(sliceMaxima) {}
+
+    void process(size_t itemId) {
+      const typename TImage::SizeType size = image->GetBufferedRegion().GetSize();
+      const size_t frameSize = size[0]*size[1];
+      const typename TImage::PixelType *slice = image->GetBufferPointer()+itemId*frameSize;
+      typename TImage::PixelType maxValue = 0;
+      for(size_t i=0;i<frameSize;i++)
+        if(slice[i] > maxValue)
+          maxValue = slice[i];
+      sliceMaxima[itemId] = getFractionalValue(maxValue, maximumFractionalValue);
+    }
+
+  private:
+    const TImage *image;
+    Uint8 maximumFractionalValue;
+    vector<Uint8> &sliceMaxima;
+  };
+
+  // Converts a slice of the input image into a fractional frame of the batch buffer
+  template<class TImage>
+  class ImageSEGConverter::FractionalFramePreparationTask : public WorkerTask {
+  public:
+    FractionalFramePreparationTask(const TImage *image, const unsigned *batchSlices, Uint8 maximumFractionalValue,
+                                   size_t frameSize, vector<Uint8> &frameBatch)
+        : image(image), batchSlices(batchSlices), maximumFractionalValue(maximumFractionalValue),
+          frameSize(frameSize), frameBatch(frameBatch) {}
+
+    void process(size_t itemId) {
+      const typename TImage::PixelType *slice = image->GetBufferPointer()+batchSlices[itemId]*frameSize;
+      Uint8 *frameData = &frameBatch[itemId*frameSize];
+      for(size_t i=0;i<frameSize;i++)
+        frameData[i] = getFractionalValue(slice[i], maximumFractionalValue);
+    }
+
+  private:
+    const TImage *image;
+    const unsigned *batchSlices;
+    Uint8 maximumFractionalValue;
+    size_t frameSize;
+    vector<Uint8> &frameBatch;
+  };
+
+  // Expands the frames of a single slice of an output image; slices do not share any
+  //  pixels, only reading from the pixel data element needs to be serialized
+  class ImageSEGConverter::FrameDecodeTask : public WorkerTask {
+  public:
+    FrameDecodeTask(DcmSegmentation *segdoc, FrameReader &frameReader, bool binary, size_t frameSize,
+                    const vector<SliceFrames> &sliceFrames, ShortPixelType *imageBuffer)
+        : segdoc(segdoc), frameReader(frameReader), binary(binary), frameSize(frameSize),
+          sliceFrames(sliceFrames), imageBuffer(imageBuffer), sliceOverlap(sliceFrames.size(), 0) {}
+
+    void process(size_t itemId) {
+      vector<Uint8> frameBuffer;
+      ShortPixelType *sliceBuffer = imageBuffer + itemId*frameSize;
+      for(size_t i=0;i<sliceFrames[itemId].size();i++){
+        const Uint8 *frameData;
+        {
+          // the holder releases the lock also when reading the frame throws
+          itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(readLock);
+          frameData = getFrameData(segdoc, frameReader, sliceFrames[itemId][i].first, binary, frameSize, frameBuffer);
+        }
+        if(expandFrame(frameData, binary, frameSize, sliceFrames[itemId][i].second, sliceBuffer))
+          sliceOverlap[itemId] = 1;
+      }
+    }
+
+    bool hasOverlap() const {
+      return find(sliceOverlap.begin(), sliceOverlap.end(), 1) != sliceOverlap.end();
+    }
+
+  private:
+    DcmSegmentation *segdoc;
+    FrameReader &frameReader;
+    bool binary;
+    size_t frameSize;
+    const vector<SliceFrames> &sliceFrames;
+    ShortPixelType *imageBuffer;
+    // one flag per slice, so that the items do not write to shared state
+    vector<char> sliceOverlap;
+    itk::SimpleFastMutexLock readLock;
+  };
+
+  // Decodes the frames of a single slice of a fractional segmentation into one of the
+  //  outputs: probabilities, fractional values, or the number of the segment with the
+  //  largest fractional value (the first one listed for the slice, on ties)
+  class ImageSEGConverter::FractionalFrameDecodeTask : public WorkerTask {
+  public:
+    FractionalFrameDecodeTask(DcmSegmentation *segdoc, FrameReader &frameReader, size_t frameSize,
+                              const vector<SliceFrames> &sliceFrames, ProbabilityPixelType *probabilityBuffer,
+                              ProbabilityPixelType probabilityScale, FractionalPixelType *fractionalBuffer,
+                              ShortPixelType *labelBuffer)
+        : segdoc(segdoc), frameReader(frameReader), frameSize(frameSize), sliceFrames(sliceFrames),
+          probabilityBuffer(probabilityBuffer), probabilityScale(probabilityScale),
+          fractionalBuffer(fractionalBuffer), labelBuffer(labelBuffer) {}
+
+    void process(size_t itemId) {
+      vector<Uint8> frameBuffer;
+      // largest value of every pixel so far, only the slice being decoded is kept
+      vector<FractionalPixelType> sliceMaxima;
+      if(labelBuffer)
+        sliceMaxima.assign(frameSize, 0);
+      const size_t sliceOffset = itemId*frameSize;
+      for(size_t i=0;i<sliceFrames[itemId].size();i++){
+        const Uint8 *frameData;
+        {
+          itk::MutexLockHolder<itk::SimpleFastMutexLock> holder(readLock);
+          frameData = getFrameData(segdoc, frameReader, sliceFrames[itemId][i].first, false, frameSize, frameBuffer);
+        }
+        if(probabilityBuffer){
+          ProbabilityPixelType *slice = probabilityBuffer+sliceOffset;
+          for(size_t pixelCnt=0;pixelCnt<frameSize;pixelCnt++)
+            slice[pixelCnt] = max(slice[pixelCnt], frameData[pixelCnt]*probabilityScale);
+        } else if(fractionalBuffer){
+          FractionalPixelType *slice = fractionalBuffer+sliceOffset;
+          for(size_t pixelCnt=0;pixelCnt<frameSize;pixelCnt++)
+            slice[pixelCnt] = max(slice[pixelCnt], frameData[pixelCnt]);
+        } else {
+          ShortPixelType *slice = labelBuffer+sliceOffset;
+          const ShortPixelType label = sliceFrames[itemId][i].second;
+          for(size_t pixelCnt=0;pixelCnt<frameSize;pixelCnt++)
+            if(frameData[pixelCnt] > sliceMaxima[pixelCnt]){
+              sliceMaxima[pixelCnt] = frameData[pixelCnt];
+              slice[pixelCnt] = label;
+            }
+        }
+      }
+    }
+
+  private:
+    DcmSegmentation *segdoc;
+    FrameReader &frameReader;
+    size_t frameSize;
+    const vector<SliceFrames> &sliceFrames;
+    ProbabilityPixelType *probabilityBuffer;
+    ProbabilityPixelType probabilityScale;
+    FractionalPixelType *fractionalBuffer;
+    ShortPixelType *labelBuffer;
+    itk::SimpleFastMutexLock readLock;
+  };
+
   DcmDataset* ImageSEGConverter::itkimage2dcmSegmentation(vector<DcmDataset*> dcmDatasets,
                                                           vector<ShortImageType::Pointer> segmentations,
                                                           const string &metaData,
-                                                          bool skipEmptySlices) {
+                                                          bool skipEmptySlices,
+                                                          bool skipEmptyFrames,
+                                                          unsigned numberOfThreads) {
 
     ShortImageType::SizeType inputSize = segmentations[0]->GetBufferedRegion().GetSize();
     //cout << "Input image size: " << inputSize << endl;
@@ -26,7 +370,6 @@ namespace dcmqi {
     CHECK_COND(ident.setInstanceNumber(metaInfo.getInstanceNumber().c_str()));
 
     /* Create new segmentation document */
-    DcmDataset segdocDataset;
     DcmSegmentation *segdoc = NULL;
 
     DcmSegmentation::createBinarySegmentation(
@@ -35,146 +378,49 @@ namespace dcmqi {
         inputSize[0],    // columns
         eq,     // equipment
         ident);   // content identification
+    // the document is deleted on every exit path, the result is a copy of its dataset
+    OFunique_ptr<DcmSegmentation> segdocHolder(segdoc);
 
-    // import Patient, Study and Frame of Reference; do not import Series
-    // attributes
-    CHECK_COND(segdoc->importHierarchy(*dcmDatasets[0], OFTrue, OFTrue, OFTrue, OFFalse));
+    initializeSegmentation(segdoc, dcmDatasets[0], segmentations[0]);
 
-    /* Initialize dimension module */
-    char dimUID[128];
-    dcmGenerateUniqueIdentifier(dimUID, QIICR_UID_ROOT);
-    IODMultiframeDimensionModule &mfdim = segdoc->getDimensions();
-    CHECK_COND(mfdim.addDimensionIndex(DCM_ReferencedSegmentNumber, dimUID, DCM_SegmentIdentificationSequence,
-                       DcmTag(DCM_ReferencedSegmentNumber).getTagName()));
-    CHECK_COND(mfdim.addDimensionIndex(DCM_ImagePositionPatient, dimUID, DCM_PlanePositionSequence,
-                       DcmTag(DCM_ImagePositionPatient).getTagName()));
-
-    /* Initialize shared functional groups */
     const unsigned frameSize = inputSize[0] * inputSize[1];
 
-    // Shared FGs: PlaneOrientationPatientSequence
-    {
-      ShortImageType::DirectionType labelDirMatrix = segmentations[0]->GetDirection();
-
-      //cout << "Directions: " << labelDirMatrix << endl;
-
-      FGPlaneOrientationPatient *planor =
-          FGPlaneOrientationPatient::createMinimal(
-              Helper::floatToStrScientific(labelDirMatrix[0][0]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[1][0]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[2][0]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[0][1]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[1][1]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[2][1]).c_str());
-
-      CHECK_COND(segdoc->addForAllFrames(*planor));
-    }
-
-    // Shared FGs: PixelMeasuresSequence
-    {
-      FGPixelMeasures *pixmsr = new FGPixelMeasures();
-
-      ShortImageType::SpacingType labelSpacing = segmentations[0]->GetSpacing();
-      ostringstream spacingSStream;
-      spacingSStream << scientific << labelSpacing[0] << "\\" << labelSpacing[1];
-      CHECK_COND(pixmsr->setPixelSpacing(spacingSStream.str().c_str()));
-
-      spacingSStream.clear(); spacingSStream.str("");
-      spacingSStream << scientific << labelSpacing[2];
-      CHECK_COND(pixmsr->setSpacingBetweenSlices(spacingSStream.str().c_str()));
-      CHECK_COND(pixmsr->setSliceThickness(spacingSStream.str().c_str()));
-      CHECK_COND(segdoc->addForAllFrames(*pixmsr));
-      delete pixmsr;
-    }
-
-
     // Iterate over the files and labels available in each file, create a segment for each label,
     //  initialize segment frames and add to the document
 
-    OFString seriesInstanceUID, classUID;
-    set<OFString> instanceUIDs;
-
-    IODCommonInstanceReferenceModule &commref = segdoc->getCommonInstanceReference();
-    OFVector<IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem*> &refseries = commref.getReferencedSeriesItems();
-
-    IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem* refseriesItem = new IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem;
+    // frames are unpacked in parallel, a batch at a time to keep memory use bounded;
+    //  only the ordered insertion into the segmentation document is serial
+    numberOfThreads = WorkerPool::getNumberOfThreads(numberOfThreads);
+    const unsigned framesPerBatch = 4*numberOfThreads;
+    vector<Uint8> frameBatch(framesPerBatch*frameSize);
+    cout << "Using " << numberOfThreads << " thread(s) to prepare segmentation frames" << endl;
 
-    OFVector<SOPInstanceReferenceMacro*> &refinstances = refseriesItem->getReferencedInstanceItems();
-
-    CHECK_COND(dcmDatasets[0]->findAndGetOFString(DCM_SeriesInstanceUID, seriesInstanceUID));
-    CHECK_COND(refseriesItem->setSeriesInstanceUID(seriesInstanceUID));
-
-    int uidfound = 0, uidnotfound = 0;
-    Uint8 *frameData = new Uint8[frameSize];
+    // statistics on the frames that are not encoded because they are empty
+    size_t totalFramesEncoded = 0, totalFramesSkipped = 0;
 
     // NB this assumes all segmentation files have the same dimensions; alternatively, need to
     //   do this operation for each segmentation file
-    vector<vector<int> > slice2derimg = getSliceMapForSegmentation2DerivationImage(dcmDatasets, segmentations[0]);
-
-    bool hasDerivationImages = false;
-    for(vector<vector<int> >::const_iterator vI=slice2derimg.begin();vI!=slice2derimg.end();++vI)
-      if((*vI).size()>0)
-        hasDerivationImages = true;
-
-
-    FGPlanePosPatient* fgppp = FGPlanePosPatient::createMinimal("1","1","1");
-    FGFrameContent* fgfc = new FGFrameContent();
-    FGDerivationImage* fgder = new FGDerivationImage();
-    OFVector<FGBase*> perFrameFGs;
-
-    perFrameFGs.push_back(fgppp);
-    perFrameFGs.push_back(fgfc);
-    if(hasDerivationImages)
-      perFrameFGs.push_back(fgder);
+    SegmentationFrameWriter frameWriter(segdoc, dcmDatasets, segmentations[0]);
 
     for(size_t segFileNumber=0; segFileNumber<segmentations.size(); segFileNumber++){
 
       //cout << "Processing input label " << segmentations[segFileNumber] << endl;
 
-      LabelToLabelMapFilterType::Pointer l2lm = LabelToLabelMapFilterType::New();
-      l2lm->SetInput(segmentations[segFileNumber]);
-      l2lm->Update();
-
-      typedef LabelToLabelMapFilterType::OutputImageType::LabelObjectType LabelType;
-      typedef itk::LabelStatisticsImageFilter<ShortImageType,ShortImageType> LabelStatisticsType;
-
-      LabelStatisticsType::Pointer labelStats = LabelStatisticsType::New();
-
-      cout << "Found " << l2lm->GetOutput()->GetNumberOfLabelObjects() << " label(s)" << endl;
-      labelStats->SetInput(segmentations[segFileNumber]);
-      labelStats->SetLabelInput(segmentations[segFileNumber]);
-      labelStats->Update();
-
-      bool cropSegmentsBBox = false;
-      if(cropSegmentsBBox){
-        cout << "WARNING: Crop operation enabled - WIP" << endl;
-        typedef itk::BinaryThresholdImageFilter<ShortImageType,ShortImageType> ThresholdType;
-        ThresholdType::Pointer thresh = ThresholdType::New();
-        thresh->SetInput(segmentations[segFileNumber]);
-        thresh->SetLowerThreshold(1);
-        thresh->SetLowerThreshold(100);
-        thresh->SetInsideValue(1);
-        thresh->Update();
-
-        LabelStatisticsType::Pointer threshLabelStats = LabelStatisticsType::New();
-
-        threshLabelStats->SetInput(thresh->GetOutput());
-        threshLabelStats->SetLabelInput(thresh->GetOutput());
-        threshLabelStats->Update();
-
-        LabelStatisticsType::BoundingBoxType threshBbox = threshLabelStats->GetBoundingBox(1);
-        /*
-        cout << "OVerall bounding box: " << threshBbox[0] << ", " << threshBbox[1]
-               << threshBbox[2] << ", " << threshBbox[3]
-               << threshBbox[4] << ", " << threshBbox[5]
-               << endl;
-               */
+      // single pass over the label image: collects bounding box and bit-packed
+      //  per-slice masks for all labels at once
+      map<short,LabelFrames> labelFramesMap;
+      scanLabelFrames(segmentations[segFileNumber], labelFramesMap, numberOfThreads);
+
+      cout << "Found " << labelFramesMap.size() << " label(s)" << endl;
+
+      // ImagePositionPatient strings depend only on the slice, not on the label
+      vector<char> slicePositions;
+      if(!computeSlicePositions(segmentations[segFileNumber], slicePositions, numberOfThreads))
         return NULL;
-      }
 
-      for(unsigned segLabelNumber=0 ; segLabelNumber<l2lm->GetOutput()->GetNumberOfLabelObjects();segLabelNumber++){
-        LabelType* labelObject = l2lm->GetOutput()->GetNthLabelObject(segLabelNumber);
-        short label = labelObject->GetLabel();
+      for(map<short,LabelFrames>::const_iterator lfI=labelFramesMap.begin();lfI!=labelFramesMap.end();++lfI){
+        const LabelFrames &labelFrames = lfI->second;
+        short label = labelFrames.label;
 
         if(!label){
           cout << "Skipping label 0" << endl;
@@ -183,7 +429,7 @@ namespace dcmqi {
 
         cout << "Processing label " << label << endl;
 
-        LabelStatisticsType::BoundingBoxType bbox = labelStats->GetBoundingBox(label);
+        const unsigned *bbox = labelFrames.bbox;
         unsigned firstSlice, lastSlice;
         //bool skipEmptySlices = true; // TODO: what to do with that line?
         //bool skipEmptySlices = false; // TODO: what to do with that line?
@@ -195,216 +441,392 @@ namespace dcmqi {
           lastSlice = inputSize[2];
         }
 
+        // slices that will be encoded as frames of this segment
+        vector<unsigned> frameSlices;
+        if(skipEmptyFrames){
+          // every empty frame is dropped, including the ones in between non-empty slices
+          for(map<unsigned, vector<Uint8> >::const_iterator sI=labelFrames.slices.begin();sI!=labelFrames.slices.end();++sI)
+            frameSlices.push_back(sI->first);
+        } else {
+          for(unsigned sliceNumber=firstSlice;sliceNumber<lastSlice;sliceNumber++)
+            frameSlices.push_back(sliceNumber);
+        }
+
         cout << "Total non-empty slices that will be encoded in SEG for label " <<
-        label << " is " << lastSlice-firstSlice << endl <<
+        label << " is " << frameSlices.size() << endl <<
         " (inclusive from " << firstSlice << " to " <<
         lastSlice << ")" << endl;
 
-        DcmSegment* segment = NULL;
+        const size_t framesSkipped = inputSize[2]-frameSlices.size();
+        totalFramesEncoded += frameSlices.size();
+        totalFramesSkipped += framesSkipped;
+        {
+          const unsigned bboxWidth = bbox[1]-bbox[0]+1, bboxHeight = bbox[3]-bbox[2]+1;
+          cout << "Label " << label << ": " << framesSkipped << " empty frame(s) not encoded, in-plane bounding box " <<
+          bboxWidth << "x" << bboxHeight << " covers " << 100.*bboxWidth*bboxHeight/frameSize << "% of the frame" << endl;
+        }
+
         if(metaInfo.segmentsAttributesMappingList[segFileNumber].find(label) == metaInfo.segmentsAttributesMappingList[segFileNumber].end()){
           cerr << "ERROR: Failed to match label from image to the segment metadata!" << endl;
           return NULL;
         }
 
-        SegmentAttributes* segmentAttributes = metaInfo.segmentsAttributesMappingList[segFileNumber][label];
+        DcmSegment* segment = createSegment(metaInfo.segmentsAttributesMappingList[segFileNumber][label]);
+        if(!segment)
+          return NULL;
 
-        DcmSegTypes::E_SegmentAlgoType algoType = DcmSegTypes::SAT_UNKNOWN;
-        string algoName = "";
-        string algoTypeStr = segmentAttributes->getSegmentAlgorithmType();
-        if(algoTypeStr == "MANUAL"){
-          algoType = DcmSegTypes::SAT_MANUAL;
-        } else {
-          if(algoTypeStr == "AUTOMATIC")
-            algoType = DcmSegTypes::SAT_AUTOMATIC;
-          if(algoTypeStr == "SEMIAUTOMATIC")
-            algoType = DcmSegTypes::SAT_SEMIAUTOMATIC;
-
-          algoName = segmentAttributes->getSegmentAlgorithmName();
-          if(algoName == ""){
-            cerr << "ERROR: Algorithm name must be specified for non-manual algorithm types!" << endl;
+        Uint16 segmentNumber;
+        CHECK_COND(segdoc->addSegment(segment, segmentNumber /* returns logical segment number */));
+
+        // iterate over slices for an individual label and populate output frames
+        for(size_t batchStart=0;batchStart<frameSlices.size();batchStart+=framesPerBatch){
+          const size_t batchEnd = min(batchStart+framesPerBatch, frameSlices.size());
+
+          FramePreparationTask framePreparationTask(labelFrames, &frameSlices[batchStart], frameSize, frameBatch);
+          if(!WorkerPool::run(framePreparationTask, batchEnd-batchStart, numberOfThreads)){
+            cerr << "ERROR: Failed to prepare frames for label " << label << endl;
             return NULL;
           }
+
+          for(size_t frameNumber=batchStart;frameNumber<batchEnd;frameNumber++){
+            const unsigned sliceNumber = frameSlices[frameNumber];
+            frameWriter.addFrame(&frameBatch[(frameNumber-batchStart)*frameSize], segmentNumber, sliceNumber,
+                                 sliceNumber-firstSlice+1, &slicePositions[3*sliceNumber*Helper::DecimalStringBufferSize]);
+          }
         }
+      }
+    }
 
-        CodeSequenceMacro* typeCode = segmentAttributes->getSegmentedPropertyTypeCodeSequence();
-        CodeSequenceMacro* categoryCode = segmentAttributes->getSegmentedPropertyCategoryCodeSequence();
-        assert(typeCode != NULL && categoryCode!= NULL);
-        OFString segmentLabel;
+    // binary frames are stored with one bit per pixel
+    cout << "Encoded " << totalFramesEncoded << " frame(s), skipped " << totalFramesSkipped <<
+    " empty frame(s) saving " << totalFramesSkipped*frameSize/8 << " bytes of PixelData" << endl;
 
-        if(segmentAttributes->getSegmentLabel().length() > 0){
-          cout << "Populating segment label to " << segmentAttributes->getSegmentLabel() << endl;
-          segmentLabel = segmentAttributes->getSegmentLabel().c_str();
-        } else
-          CHECK_COND(typeCode->getCodeMeaning(segmentLabel));
+    frameWriter.addCommonInstanceReference();
 
-        CHECK_COND(DcmSegment::create(segment, segmentLabel, *categoryCode, *typeCode, algoType, algoName.c_str()));
+    return writeSegmentation(segdoc, metaInfo, dcmDatasets[0]);
+  }
 
-        if(segmentAttributes->getSegmentDescription().length() > 0)
-          segment->setSegmentDescription(segmentAttributes->getSegmentDescription().c_str());
+  DcmDataset* ImageSEGConverter::itkimage2dcmFractionalSegmentation(vector<DcmDataset*> dcmDatasets,
+      vector<ProbabilityImageType::Pointer> probabilityMaps,
+      const string &metaData,
+      DcmSegTypes::E_SegmentationFractionalType fractionalType,
+      Uint8 maximumFractionalValue,
+      bool skipEmptySlices,
+      bool skipEmptyFrames,
+      unsigned numberOfThreads) {
+    return encodeFractionalSegmentation<ProbabilityImageType>(dcmDatasets, probabilityMaps, metaData,
+                                                              fractionalType, maximumFractionalValue,
+                                                              skipEmptySlices, skipEmptyFrames, numberOfThreads);
+  }
 
-        if(segmentAttributes->getTrackingIdentifier().length() > 0)
-          segment->setTrackingID(segmentAttributes->getTrackingIdentifier().c_str());
+  DcmDataset* ImageSEGConverter::itkimage2dcmFractionalSegmentation(vector<DcmDataset*> dcmDatasets,
+      vector<FractionalImageType::Pointer> fractionalMaps,
+      const string &metaData,
+      DcmSegTypes::E_SegmentationFractionalType fractionalType,
+      Uint8 maximumFractionalValue,
+      bool skipEmptySlices,
+      bool skipEmptyFrames,
+      unsigned numberOfThreads) {
+    return encodeFractionalSegmentation<FractionalImageType>(dcmDatasets, fractionalMaps, metaData,
+                                                             fractionalType, maximumFractionalValue,
+                                                             skipEmptySlices, skipEmptyFrames, numberOfThreads);
+  }
 
-        if(segmentAttributes->getTrackingUniqueIdentifier().length() > 0)
-          segment->setTrackingUID(segmentAttributes->getTrackingUniqueIdentifier().c_str());
+  template<class TImage>
+  DcmDataset* ImageSEGConverter::encodeFractionalSegmentation(vector<DcmDataset*> &dcmDatasets,
+      const vector<typename TImage::Pointer> &images, const string &metaData,
+      DcmSegTypes::E_SegmentationFractionalType fractionalType, Uint8 maximumFractionalValue,
+      bool skipEmptySlices, bool skipEmptyFrames, unsigned numberOfThreads) {
 
-        CodeSequenceMacro* typeModifierCode = segmentAttributes->getSegmentedPropertyTypeModifierCodeSequence();
-        if (typeModifierCode != NULL) {
-          OFVector<CodeSequenceMacro*>& modifiersVector = segment->getSegmentedPropertyTypeModifierCode();
-          modifiersVector.push_back(typeModifierCode);
-        }
+    typename TImage::SizeType inputSize = images[0]->GetBufferedRegion().GetSize();
 
-        GeneralAnatomyMacro &anatomyMacro = segment->getGeneralAnatomyCode();
-        if (segmentAttributes->getAnatomicRegionSequence() != NULL){
-          OFVector<CodeSequenceMacro*>& anatomyMacroModifiersVector = anatomyMacro.getAnatomicRegionModifier();
-          CodeSequenceMacro& anatomicRegionSequence = anatomyMacro.getAnatomicRegion();
-          anatomicRegionSequence = *segmentAttributes->getAnatomicRegionSequence();
+    JSONSegmentationMetaInformationHandler metaInfo(metaData.c_str());
+    metaInfo.read();
 
-          if(segmentAttributes->getAnatomicRegionModifierSequence() != NULL){
-            CodeSequenceMacro* anatomicRegionModifierSequence = segmentAttributes->getAnatomicRegionModifierSequence();
-            anatomyMacroModifiersVector.push_back(anatomicRegionModifierSequence);
-          }
-        }
+    if(metaInfo.segmentsAttributesMappingList.size() != images.size()){
+      cerr << "Mismatch between the number of input segmentation files and the size of metainfo list!" << endl;
+      return NULL;
+    }
+    for(size_t segFileNumber=0;segFileNumber<images.size();segFileNumber++){
+      if(metaInfo.segmentsAttributesMappingList[segFileNumber].size() != 1){
+        cerr << "ERROR: Exactly one segment should be described for each fractional segmentation file!" << endl;
+        return NULL;
+      }
+    }
+    if(!maximumFractionalValue){
+      cerr << "ERROR: Maximum fractional value should be in the range 1..255!" << endl;
+      return NULL;
+    }
 
-        unsigned* rgb = segmentAttributes->getRecommendedDisplayRGBValue();
-        unsigned cielabScaled[3];
-        float cielab[3], ciexyz[3];
+    IODGeneralEquipmentModule::EquipmentInfo eq = getEquipmentInfo();
+    ContentIdentificationMacro ident = createContentIdentificationInformation(metaInfo);
+    CHECK_COND(ident.setInstanceNumber(metaInfo.getInstanceNumber().c_str()));
 
-        Helper::getCIEXYZFromRGB(&rgb[0],&ciexyz[0]);
-        Helper::getCIELabFromCIEXYZ(&ciexyz[0],&cielab[0]);
-        Helper::getIntegerScaledCIELabFromCIELab(&cielab[0],&cielabScaled[0]);
-        CHECK_COND(segment->setRecommendedDisplayCIELabValue(cielabScaled[0],cielabScaled[1],cielabScaled[2]));
+    DcmSegmentation *segdoc = NULL;
+    CHECK_COND(DcmSegmentation::createFractionalSegmentation(segdoc, inputSize[1], inputSize[0], fractionalType,
+                                                             maximumFractionalValue, eq, ident));
+    // the document is deleted on every exit path, the result is a copy of its dataset
+    OFunique_ptr<DcmSegmentation> segdocHolder(segdoc);
 
-        Uint16 segmentNumber;
-        CHECK_COND(segdoc->addSegment(segment, segmentNumber /* returns logical segment number */));
+    initializeSegmentation(segdoc, dcmDatasets[0], images[0]);
 
-        // TODO: make it possible to skip empty frames (optional)
-        // iterate over slices for an individual label and populate output frames
-        for(unsigned sliceNumber=firstSlice;sliceNumber<lastSlice;sliceNumber++){
-
-          // PerFrame FG: FrameContentSequence
-          //fracon->setStackID("1"); // all frames go into the same stack
-          CHECK_COND(fgfc->setDimensionIndexValues(segmentNumber, 0));
-          CHECK_COND(fgfc->setDimensionIndexValues(sliceNumber-firstSlice+1, 1));
-          //ostringstream inStackPosSStream; // StackID is not present/needed
-          //inStackPosSStream << s+1;
-          //fracon->setInStackPositionNumber(s+1);
-
-          // PerFrame FG: PlanePositionSequence
-          {
-            ShortImageType::PointType sliceOriginPoint;
-            ShortImageType::IndexType sliceOriginIndex;
-            sliceOriginIndex.Fill(0);
-            sliceOriginIndex[2] = sliceNumber;
-            segmentations[segFileNumber]->TransformIndexToPhysicalPoint(sliceOriginIndex, sliceOriginPoint);
-            ostringstream pppSStream;
-            if(sliceNumber>0){
-              ShortImageType::PointType prevOrigin;
-              ShortImageType::IndexType prevIndex;
-              prevIndex.Fill(0);
-              prevIndex[2] = sliceNumber-1;
-              segmentations[segFileNumber]->TransformIndexToPhysicalPoint(prevIndex, prevOrigin);
-            }
-            fgppp->setImagePositionPatient(
-                Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
-                Helper::floatToStrScientific(sliceOriginPoint[1]).c_str(),
-                Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
-          }
+    const unsigned frameSize = inputSize[0] * inputSize[1];
 
-          /* Add frame that references this segment */
-          {
-            ShortImageType::RegionType sliceRegion;
-            ShortImageType::IndexType sliceIndex;
-            ShortImageType::SizeType sliceSize;
-
-            sliceIndex[0] = 0;
-            sliceIndex[1] = 0;
-            sliceIndex[2] = sliceNumber;
-
-            sliceSize[0] = inputSize[0];
-            sliceSize[1] = inputSize[1];
-            sliceSize[2] = 1;
-
-            sliceRegion.SetIndex(sliceIndex);
-            sliceRegion.SetSize(sliceSize);
-
-            unsigned framePixelCnt = 0;
-            itk::ImageRegionConstIteratorWithIndex<ShortImageType> sliceIterator(segmentations[segFileNumber], sliceRegion);
-            for(sliceIterator.GoToBegin();!sliceIterator.IsAtEnd();++sliceIterator,++framePixelCnt){
-              if(sliceIterator.Get() == label){
-                frameData[framePixelCnt] = 1;
-                ShortImageType::IndexType idx = sliceIterator.GetIndex();
-                //cout << framePixelCnt << " " << idx[1] << "," << idx[0] << endl;
-              } else
-                frameData[framePixelCnt] = 0;
-            }
+    numberOfThreads = WorkerPool::getNumberOfThreads(numberOfThreads);
+    const unsigned framesPerBatch = 4*numberOfThreads;
+    vector<Uint8> frameBatch;
+    cout << "Using " << numberOfThreads << " thread(s) to prepare segmentation frames" << endl;
 
-            /*
-            if(sliceNumber>=dcmDatasets.size()){
-              cerr << "ERROR: trying to access missing DICOM Slice! And sorry, multi-frame not supported at the moment..." << endl;
-              return NULL;
-            }*/
-
-            OFVector<DcmDataset*> siVector;
-            for(size_t derImageInstanceNum=0;
-                derImageInstanceNum<slice2derimg[sliceNumber].size();
-                derImageInstanceNum++){
-              siVector.push_back(dcmDatasets[slice2derimg[sliceNumber][derImageInstanceNum]]);
-            }
+    size_t totalFramesEncoded = 0, totalFramesSkipped = 0;
 
-            if(siVector.size()>0){
-
-              DerivationImageItem *derimgItem;
-              CHECK_COND(fgder->addDerivationImageItem(CodeSequenceMacro("113076","DCM","Segmentation"),"",derimgItem));
-
-              //cout << "Total of " << siVector.size() << " source image items will be added" << endl;
-
-              OFVector<SourceImageItem*> srcimgItems;
-              CHECK_COND(derimgItem->addSourceImageItems(siVector,
-                                                       CodeSequenceMacro("121322","DCM","Source image for image processing operation"),
-                                                       srcimgItems));
-
-              if(1){
-                // initialize class UID and series instance UID
-                ImageSOPInstanceReferenceMacro &instRef = srcimgItems[0]->getImageSOPInstanceReference();
-                OFString instanceUID;
-                CHECK_COND(instRef.getReferencedSOPClassUID(classUID));
-                CHECK_COND(instRef.getReferencedSOPInstanceUID(instanceUID));
-
-                if(instanceUIDs.find(instanceUID) == instanceUIDs.end()){
-                  SOPInstanceReferenceMacro *refinstancesItem = new SOPInstanceReferenceMacro();
-                  CHECK_COND(refinstancesItem->setReferencedSOPClassUID(classUID));
-                  CHECK_COND(refinstancesItem->setReferencedSOPInstanceUID(instanceUID));
-                  refinstances.push_back(refinstancesItem);
-                  instanceUIDs.insert(instanceUID);
-                  uidnotfound++;
-                } else {
-                  uidfound++;
-                }
-              }
-            }
+    SegmentationFrameWriter frameWriter(segdoc, dcmDatasets, images[0]);
 
-            CHECK_COND(segdoc->addFrame(frameData, segmentNumber, perFrameFGs));
+    for(size_t segFileNumber=0;segFileNumber<images.size();segFileNumber++){
+      const TImage *image = images[segFileNumber];
+      const size_t numberOfSlices = image->GetBufferedRegion().GetSize()[2];
 
-            // remove derivation image FG from the per-frame FGs, only if applicable!
-            if(siVector.size()>0){
-              // clean up for the next frame
-              fgder->clearData();
-            }
+      // largest fractional value of every slice, to find the empty frames without
+      //  converting all of them
+      vector<Uint8> sliceMaxima(numberOfSlices);
+      FractionalScanTask<TImage> scanTask(image, maximumFractionalValue, sliceMaxima);
+      if(!WorkerPool::run(scanTask, numberOfSlices, numberOfThreads)){
+        cerr << "ERROR: Failed to scan fractional segmentation file " << segFileNumber+1 << endl;
+        return NULL;
+      }
+
+      vector<unsigned> nonEmptySlices;
+      for(unsigned sliceNumber=0;sliceNumber<numberOfSlices;sliceNumber++)
+        if(sliceMaxima[sliceNumber])
+          nonEmptySlices.push_back(sliceNumber);
+
+      // the segment of an empty file is still created, so that the segment numbers
+      //  match the metadata; if empty frames are skipped, its first frame is kept
+      unsigned firstSlice = 0, lastSlice = numberOfSlices;
+      if(nonEmptySlices.empty()){
+        cerr << "WARNING: Fractional segmentation file " << segFileNumber+1 << " is empty" << endl;
+        if(skipEmptySlices || skipEmptyFrames)
+          lastSlice = 1;
+      } else if(skipEmptySlices){
+        firstSlice = nonEmptySlices.front();
+        lastSlice = nonEmptySlices.back()+1;
+      }
+      vector<unsigned> frameSlices;
+      if(skipEmptyFrames && !nonEmptySlices.empty()){
+        frameSlices = nonEmptySlices;
+      } else {
+        for(unsigned sliceNumber=firstSlice;sliceNumber<lastSlice;sliceNumber++)
+          frameSlices.push_back(sliceNumber);
+      }
+
+      totalFramesEncoded += frameSlices.size();
+      totalFramesSkipped += numberOfSlices-frameSlices.size();
+      cout << "Segment from file " << segFileNumber+1 << ": " << frameSlices.size() << " frame(s) encoded, " <<
+      numberOfSlices-frameSlices.size() << " empty frame(s) not encoded" << endl;
+
+      vector<char> slicePositions;
+      if(!computeSlicePositions(image, slicePositions, numberOfThreads))
+        return NULL;
+
+      DcmSegment* segment = createSegment(metaInfo.segmentsAttributesMappingList[segFileNumber].begin()->second);
+      if(!segment)
+        return NULL;
 
+      Uint16 segmentNumber;
+      CHECK_COND(segdoc->addSegment(segment, segmentNumber));
+
+      // 8-bit fractional values that use the full range are the frames as they are
+      //  stored, which are added straight from the image buffer
+      const bool storedAsIs = sizeof(typename TImage::PixelType) == 1 && maximumFractionalValue == 255;
+      if(!storedAsIs)
+        frameBatch.resize(framesPerBatch*frameSize);
+
+      for(size_t batchStart=0;batchStart<frameSlices.size();batchStart+=framesPerBatch){
+        const size_t batchEnd = min(batchStart+framesPerBatch, frameSlices.size());
+
+        if(!storedAsIs){
+          FractionalFramePreparationTask<TImage> framePreparationTask(image, &frameSlices[batchStart],
+                                                                      maximumFractionalValue, frameSize, frameBatch);
+          if(!WorkerPool::run(framePreparationTask, batchEnd-batchStart, numberOfThreads)){
+            cerr << "ERROR: Failed to prepare frames for fractional segmentation file " << segFileNumber+1 << endl;
+            return NULL;
           }
         }
+
+        for(size_t frameNumber=batchStart;frameNumber<batchEnd;frameNumber++){
+          const unsigned sliceNumber = frameSlices[frameNumber];
+          Uint8 *frameData = storedAsIs ?
+              reinterpret_cast<Uint8*>(images[segFileNumber]->GetBufferPointer())+size_t(sliceNumber)*frameSize :
+              &frameBatch[(frameNumber-batchStart)*frameSize];
+          frameWriter.addFrame(frameData, segmentNumber, sliceNumber, sliceNumber-firstSlice+1,
+                               &slicePositions[3*sliceNumber*Helper::DecimalStringBufferSize]);
+        }
       }
     }
 
-    // add ReferencedSeriesItem only if it is not empty
-    if(refinstances.size())
-      refseries.push_back(refseriesItem);
+    // fractional frames are stored with one byte per pixel
+    cout << "Encoded " << totalFramesEncoded << " frame(s), skipped " << totalFramesSkipped <<
+    " empty frame(s) saving " << totalFramesSkipped*frameSize << " bytes of PixelData" << endl;
+
+    frameWriter.addCommonInstanceReference();
+
+    return writeSegmentation(segdoc, metaInfo, dcmDatasets[0]);
+  }
+
+  Uint8 ImageSEGConverter::getFractionalValue(ProbabilityPixelType probability, Uint8 maximumFractionalValue) {
+    // NaN is treated as 0
+    if(!(probability > 0))
+      return 0;
+    if(probability >= 1)
+      return maximumFractionalValue;
+    return Uint8(probability*maximumFractionalValue+.5f);
+  }
+
+  Uint8 ImageSEGConverter::getFractionalValue(FractionalPixelType value, Uint8 maximumFractionalValue) {
+    return min(value, maximumFractionalValue);
+  }
+
+  void ImageSEGConverter::initializeSegmentation(DcmSegmentation *segdoc, DcmDataset *sourceDataset,
+                                                 const itk::ImageBase<3> *image) {
+    // import Patient, Study and Frame of Reference; do not import Series
+    // attributes
+    CHECK_COND(segdoc->importHierarchy(*sourceDataset, OFTrue, OFTrue, OFTrue, OFFalse));
 
-    delete fgfc;
-    delete fgppp;
-    delete fgder;
+    /* Initialize dimension module */
+    char dimUID[128];
+    dcmGenerateUniqueIdentifier(dimUID, QIICR_UID_ROOT);
+    IODMultiframeDimensionModule &mfdim = segdoc->getDimensions();
+    CHECK_COND(mfdim.addDimensionIndex(DCM_ReferencedSegmentNumber, dimUID, DCM_SegmentIdentificationSequence,
+                       DcmTag(DCM_ReferencedSegmentNumber).getTagName()));
+    CHECK_COND(mfdim.addDimensionIndex(DCM_ImagePositionPatient, dimUID, DCM_PlanePositionSequence,
+                       DcmTag(DCM_ImagePositionPatient).getTagName()));
+
+    /* Initialize shared functional groups */
+
+    // Shared FGs: PlaneOrientationPatientSequence
+    {
+      itk::ImageBase<3>::DirectionType labelDirMatrix = image->GetDirection();
+
+      //cout << "Directions: " << labelDirMatrix << endl;
+
+      char orientation[6][Helper::DecimalStringBufferSize];
+      for(int j=0;j<6;j++)
+        Helper::floatToDecimalString(labelDirMatrix[j%3][j/3], orientation[j]);
+      FGPlaneOrientationPatient *planor =
+          FGPlaneOrientationPatient::createMinimal(
+              orientation[0], orientation[1], orientation[2], orientation[3], orientation[4], orientation[5]);
 
+      CHECK_COND(segdoc->addForAllFrames(*planor));
+    }
+
+    // Shared FGs: PixelMeasuresSequence
+    {
+      FGPixelMeasures *pixmsr = new FGPixelMeasures();
+
+      itk::ImageBase<3>::SpacingType labelSpacing = image->GetSpacing();
+      char pixelSpacing[2*Helper::DecimalStringBufferSize], sliceSpacing[Helper::DecimalStringBufferSize];
+      Helper::floatToDecimalString(labelSpacing[0], pixelSpacing);
+      strcat(pixelSpacing, "\\");
+      Helper::floatToDecimalString(labelSpacing[1], pixelSpacing+strlen(pixelSpacing));
+      CHECK_COND(pixmsr->setPixelSpacing(pixelSpacing));
+
+      Helper::floatToDecimalString(labelSpacing[2], sliceSpacing);
+      CHECK_COND(pixmsr->setSpacingBetweenSlices(sliceSpacing));
+      CHECK_COND(pixmsr->setSliceThickness(sliceSpacing));
+      CHECK_COND(segdoc->addForAllFrames(*pixmsr));
+      delete pixmsr;
+    }
+  }
+
+  bool ImageSEGConverter::computeSlicePositions(const itk::ImageBase<3> *image, vector<char> &slicePositions,
+                                                unsigned numberOfThreads) {
+    // the strings are kept in one buffer of fixed size entries
+    const size_t numberOfSlices = image->GetBufferedRegion().GetSize()[2];
+    slicePositions.resize(3*numberOfSlices*Helper::DecimalStringBufferSize);
+    SlicePositionTask slicePositionTask(image, slicePositions);
+    if(!WorkerPool::run(slicePositionTask, numberOfSlices, numberOfThreads)){
+      cerr << "ERROR: Failed to compute slice positions!" << endl;
+      return false;
+    }
+    return true;
+  }
+
+  DcmSegment* ImageSEGConverter::createSegment(SegmentAttributes *segmentAttributes) {
+    DcmSegment* segment = NULL;
+
+    DcmSegTypes::E_SegmentAlgoType algoType = DcmSegTypes::SAT_UNKNOWN;
+    string algoName = "";
+    string algoTypeStr = segmentAttributes->getSegmentAlgorithmType();
+    if(algoTypeStr == "MANUAL"){
+      algoType = DcmSegTypes::SAT_MANUAL;
+    } else {
+      if(algoTypeStr == "AUTOMATIC")
+        algoType = DcmSegTypes::SAT_AUTOMATIC;
+      if(algoTypeStr == "SEMIAUTOMATIC")
+        algoType = DcmSegTypes::SAT_SEMIAUTOMATIC;
+
+      algoName = segmentAttributes->getSegmentAlgorithmName();
+      if(algoName == ""){
+        cerr << "ERROR: Algorithm name must be specified for non-manual algorithm types!" << endl;
+        return NULL;
+      }
+    }
+
+    CodeSequenceMacro* typeCode = segmentAttributes->getSegmentedPropertyTypeCodeSequence();
+    CodeSequenceMacro* categoryCode = segmentAttributes->getSegmentedPropertyCategoryCodeSequence();
+    assert(typeCode != NULL && categoryCode!= NULL);
+    OFString segmentLabel;
+
+    if(segmentAttributes->getSegmentLabel().length() > 0){
+      cout << "Populating segment label to " << segmentAttributes->getSegmentLabel() << endl;
+      segmentLabel = segmentAttributes->getSegmentLabel().c_str();
+    } else
+      CHECK_COND(typeCode->getCodeMeaning(segmentLabel));
+
+    CHECK_COND(DcmSegment::create(segment, segmentLabel, *categoryCode, *typeCode, algoType, algoName.c_str()));
+
+    if(segmentAttributes->getSegmentDescription().length() > 0)
+      segment->setSegmentDescription(segmentAttributes->getSegmentDescription().c_str());
+
+    if(segmentAttributes->getTrackingIdentifier().length() > 0)
+      segment->setTrackingID(segmentAttributes->getTrackingIdentifier().c_str());
+
+    if(segmentAttributes->getTrackingUniqueIdentifier().length() > 0)
+      segment->setTrackingUID(segmentAttributes->getTrackingUniqueIdentifier().c_str());
+
+    CodeSequenceMacro* typeModifierCode = segmentAttributes->getSegmentedPropertyTypeModifierCodeSequence();
+    if (typeModifierCode != NULL) {
+      OFVector<CodeSequenceMacro*>& modifiersVector = segment->getSegmentedPropertyTypeModifierCode();
+      modifiersVector.push_back(typeModifierCode);
+    }
+
+    GeneralAnatomyMacro &anatomyMacro = segment->getGeneralAnatomyCode();
+    if (segmentAttributes->getAnatomicRegionSequence() != NULL){
+      OFVector<CodeSequenceMacro*>& anatomyMacroModifiersVector = anatomyMacro.getAnatomicRegionModifier();
+      CodeSequenceMacro& anatomicRegionSequence = anatomyMacro.getAnatomicRegion();
+      anatomicRegionSequence = *segmentAttributes->getAnatomicRegionSequence();
+
+      if(segmentAttributes->getAnatomicRegionModifierSequence() != NULL){
+        CodeSequenceMacro* anatomicRegionModifierSequence = segmentAttributes->getAnatomicRegionModifierSequence();
+        anatomyMacroModifiersVector.push_back(anatomicRegionModifierSequence);
+      }
+    }
+
+    unsigned* rgb = segmentAttributes->getRecommendedDisplayRGBValue();
+    unsigned cielabScaled[3];
+    float cielab[3], ciexyz[3];
+
+    Helper::getCIEXYZFromRGB(&rgb[0],&ciexyz[0]);
+    Helper::getCIELabFromCIEXYZ(&ciexyz[0],&cielab[0]);
+    Helper::getIntegerScaledCIELabFromCIELab(&cielab[0],&cielabScaled[0]);
+    CHECK_COND(segment->setRecommendedDisplayCIELabValue(cielabScaled[0],cielabScaled[1],cielabScaled[2]));
+
+    return segment;
+  }
+
+  DcmDataset* ImageSEGConverter::writeSegmentation(DcmSegmentation *segdoc,
+                                                   JSONSegmentationMetaInformationHandler &metaInfo,
+                                                   DcmDataset *sourceDataset) {
+    DcmDataset segdocDataset;
     segdoc->getSeries().setSeriesNumber(metaInfo.getSeriesNumber().c_str());
 
     OFString frameOfRefUID;
@@ -434,7 +856,7 @@ namespace dcmqi {
       string bodyPartAssigned = metaInfo.getBodyPartExamined();
 
       // inherit BodyPartExamined from the source image dataset, if available
-      if(dcmDatasets[0]->findAndGetOFString(DCM_BodyPartExamined, bodyPartStr).good())
+      if(sourceDataset->findAndGetOFString(DCM_BodyPartExamined, bodyPartStr).good())
       if(string(bodyPartStr.c_str()).size())
         bodyPartAssigned = bodyPartStr.c_str();
 
@@ -460,19 +882,289 @@ namespace dcmqi {
   }
 
 
-  pair <map<unsigned,ShortImageType::Pointer>, string> ImageSEGConverter::dcmSegmentation2itkimage(DcmDataset *segDataset) {
+  void ImageSEGConverter::scanLabelFrames(const ShortImageType::Pointer &labelImage,
+                                          map<short,LabelFrames> &labelFrames,
+                                          unsigned numberOfThreads) {
+    const unsigned numSlices = labelImage->GetBufferedRegion().GetSize()[2];
+    numberOfThreads = WorkerPool::getNumberOfThreads(numberOfThreads);
+    const unsigned slicesPerSlab = max(1u, (numSlices+numberOfThreads-1)/numberOfThreads);
+    const unsigned numSlabs = (numSlices+slicesPerSlab-1)/slicesPerSlab;
+
+    // each slab is scanned into its own map, slabs are merged in slice order afterwards
+    vector<map<short,LabelFrames> > slabLabelFrames(numSlabs);
+    LabelScanTask labelScanTask(labelImage, slicesPerSlab, slabLabelFrames);
+    if(!WorkerPool::run(labelScanTask, numSlabs, numberOfThreads)){
+      cerr << "ERROR: Failed to scan the label image!" << endl;
+      throw -1;
+    }
+
+    labelFrames.clear();
+    for(unsigned slab=0;slab<numSlabs;slab++)
+      mergeLabelFrames(labelFrames, slabLabelFrames[slab]);
+  }
+
+  void ImageSEGConverter::mergeLabelFrames(map<short,LabelFrames> &labelFrames,
+                                           map<short,LabelFrames> &slabLabelFrames) {
+    for(map<short,LabelFrames>::iterator sI=slabLabelFrames.begin();sI!=slabLabelFrames.end();++sI){
+      LabelFrames &slabEntry = sI->second;
+      map<short,LabelFrames>::iterator lI = labelFrames.find(sI->first);
+      if(lI == labelFrames.end()){
+        LabelFrames &entry = labelFrames[sI->first];
+        entry.label = slabEntry.label;
+        copy(slabEntry.bbox, slabEntry.bbox+6, entry.bbox);
+        entry.slices.swap(slabEntry.slices);
+        continue;
+      }
+      LabelFrames &entry = lI->second;
+      for(int i=0;i<6;i+=2){
+        entry.bbox[i] = min(entry.bbox[i], slabEntry.bbox[i]);
+        entry.bbox[i+1] = max(entry.bbox[i+1], slabEntry.bbox[i+1]);
+      }
+      // slabs do not overlap, so the slice masks can be moved over as they are
+      for(map<unsigned, vector<Uint8> >::iterator fI=slabEntry.slices.begin();fI!=slabEntry.slices.end();++fI)
+        entry.slices[fI->first].swap(fI->second);
+    }
+  }
+
+  void ImageSEGConverter::scanLabelFrames(const ShortImageType::Pointer &labelImage,
+                                          unsigned firstSlice, unsigned lastSlice,
+                                          map<short,LabelFrames> &labelFrames) {
+    ShortImageType::SizeType imageSize = labelImage->GetBufferedRegion().GetSize();
+    const size_t frameSize = imageSize[0] * imageSize[1];
+    const size_t packedFrameSize = (frameSize+7)/8;
+    const ShortPixelType *pixel = labelImage->GetBufferPointer() + firstSlice*frameSize;
+
+    // direct lookup tables indexed by the label value, so that the voxel loop does
+    //  not need to search the map; sliceData caches the mask of the current slice
+    const int labelOffset = -itk::NumericTraits<ShortPixelType>::min();
+    const size_t numLabelValues = size_t(itk::NumericTraits<ShortPixelType>::max()+labelOffset+1);
+    vector<LabelFrames*> labelLookup(numLabelValues, static_cast<LabelFrames*>(NULL));
+    vector<Uint8*> sliceData(numLabelValues, static_cast<Uint8*>(NULL));
+    vector<unsigned> sliceDataNumber(numLabelValues, 0);
+
+    labelFrames.clear();
+
+    for(unsigned z=firstSlice;z<lastSlice;z++){
+      for(unsigned y=0;y<imageSize[1];y++){
+        for(unsigned x=0;x<imageSize[0];x++,pixel++){
+          const int lookupId = *pixel + labelOffset;
+          LabelFrames *entry = labelLookup[lookupId];
+          if(!entry){
+            entry = &labelFrames[*pixel];
+            entry->label = *pixel;
+            entry->bbox[0] = entry->bbox[1] = x;
+            entry->bbox[2] = entry->bbox[3] = y;
+            entry->bbox[4] = entry->bbox[5] = z;
+            labelLookup[lookupId] = entry;
+          } else {
+            if(x<entry->bbox[0]) entry->bbox[0] = x;
+            if(x>entry->bbox[1]) entry->bbox[1] = x;
+            if(y<entry->bbox[2]) entry->bbox[2] = y;
+            if(y>entry->bbox[3]) entry->bbox[3] = y;
+            entry->bbox[5] = z;
+          }
+
+          // background is never encoded, there is no need to keep its masks
+          if(!*pixel)
+            continue;
+
+          if(!sliceData[lookupId] || sliceDataNumber[lookupId] != z){
+            vector<Uint8> &packedFrame = entry->slices[z];
+            packedFrame.resize(packedFrameSize, 0);
+            sliceData[lookupId] = &packedFrame[0];
+            sliceDataNumber[lookupId] = z;
+          }
+          const size_t bitCnt = y*imageSize[0]+x;
+          sliceData[lookupId][bitCnt >> 3] |= Uint8(1 << (bitCnt & 7));
+        }
+      }
+    }
+  }
+
+  void ImageSEGConverter::unpackLabelFrame(const Uint8 *packedFrame, Uint8 *frameData, size_t frameSize) {
+    for(size_t bitCnt=0;bitCnt<frameSize;bitCnt++)
+      frameData[bitCnt] = (packedFrame[bitCnt >> 3] >> (bitCnt & 7)) & 1;
+  }
+
+
+  bool ImageSEGConverter::expandBinaryFrame(const Uint8 *packedFrame, size_t frameSize,
+                                            ShortPixelType value, ShortPixelType *sliceBuffer) {
+    // segmentations are mostly empty, so skip the packed frame one machine word
+    //  (and then one byte) at a time, and only look at the bits of non-zero bytes
+    const size_t wordBytes = sizeof(size_t);
+    const size_t fullBytes = frameSize >> 3;
+    bool overlap = false;
+    size_t byteCnt = 0;
+    while(byteCnt<fullBytes){
+      if(byteCnt+wordBytes <= fullBytes){
+        size_t word;
+        memcpy(&word, packedFrame+byteCnt, wordBytes);
+        if(!word){
+          byteCnt += wordBytes;
+          continue;
+        }
+      }
+      const size_t wordEnd = min(byteCnt+wordBytes, fullBytes);
+      for(;byteCnt<wordEnd;byteCnt++){
+        Uint8 byte = packedFrame[byteCnt];
+        ShortPixelType *pixel = sliceBuffer + (byteCnt << 3);
+        for(;byte;byte >>= 1,pixel++)
+          if(byte & 1){
+            if(*pixel && *pixel != value)
+              overlap = true;
+            *pixel = value;
+          }
+      }
+    }
+    // trailing bits of the last byte, if the frame size is not a multiple of 8
+    for(size_t bitCnt=fullBytes << 3;bitCnt<frameSize;bitCnt++)
+      if((packedFrame[bitCnt >> 3] >> (bitCnt & 7)) & 1){
+        if(sliceBuffer[bitCnt] && sliceBuffer[bitCnt] != value)
+          overlap = true;
+        sliceBuffer[bitCnt] = value;
+      }
+    return overlap;
+  }
+
+  bool ImageSEGConverter::expandFrame(const Uint8 *frameData, bool binary, size_t frameSize,
+                                      ShortPixelType value, ShortPixelType *sliceBuffer) {
+    if(binary)
+      return expandBinaryFrame(frameData, frameSize, value, sliceBuffer);
+
+    bool overlap = false;
+    for(size_t pixelCnt=0;pixelCnt<frameSize;pixelCnt++)
+      if(frameData[pixelCnt]){
+        if(sliceBuffer[pixelCnt] && sliceBuffer[pixelCnt] != value)
+          overlap = true;
+        sliceBuffer[pixelCnt] = value;
+      }
+    return overlap;
+  }
+
+  void ImageSEGConverter::expandFrameRegion(const Uint8 *frameData, bool binary, unsigned columns,
+                                            const unsigned *bbox, ShortPixelType value, ShortPixelType *sliceBuffer) {
+    for(unsigned y=bbox[2];y<=bbox[3];y++){
+      size_t pixelCnt = size_t(y)*columns+bbox[0];
+      for(unsigned x=bbox[0];x<=bbox[1];x++,pixelCnt++,sliceBuffer++){
+        if(binary ? (frameData[pixelCnt >> 3] >> (pixelCnt & 7)) & 1 : frameData[pixelCnt])
+          *sliceBuffer = value;
+      }
+    }
+  }
+
+  bool ImageSEGConverter::getFrameBoundingBox(const Uint8 *frameData, bool binary,
+                                              unsigned columns, unsigned rows, unsigned *bbox) {
+    bool nonEmpty = false;
+    const size_t frameSize = size_t(columns)*rows;
+    for(size_t pixelCnt=0;pixelCnt<frameSize;pixelCnt++){
+      if(binary){
+        // skip empty bytes as a whole
+        if(!(pixelCnt & 7) && !frameData[pixelCnt >> 3] && pixelCnt+8 <= frameSize){
+          pixelCnt += 7;
+          continue;
+        }
+        if(!((frameData[pixelCnt >> 3] >> (pixelCnt & 7)) & 1))
+          continue;
+      } else if(!frameData[pixelCnt]) {
+        continue;
+      }
+      const unsigned x = unsigned(pixelCnt % columns), y = unsigned(pixelCnt / columns);
+      if(!nonEmpty){
+        bbox[0] = bbox[1] = x;
+        bbox[2] = bbox[3] = y;
+        nonEmpty = true;
+      } else {
+        if(x<bbox[0]) bbox[0] = x;
+        if(x>bbox[1]) bbox[1] = x;
+        if(y<bbox[2]) bbox[2] = y;
+        if(y>bbox[3]) bbox[3] = y;
+      }
+    }
+    return nonEmpty;
+  }
+
+  const Uint8* ImageSEGConverter::getFrameData(DcmSegmentation *segdoc, FrameReader &frameReader, size_t frameId,
+                                               bool binary, size_t frameSize, vector<Uint8> &frameBuffer) {
+    const size_t frameLength = binary ? (frameSize+7)/8 : frameSize;
+    if(frameReader.isDetached()){
+      // pixel data is not part of the dataset, read only this frame from it
+      frameBuffer.resize(frameLength);
+      if(!frameReader.readFrame(frameId, binary ? frameSize : frameSize*8, &frameBuffer[0], EBO_LittleEndian)){
+        cerr << "ERROR: Failed to read frame " << frameId << "!" << endl;
+        throw -1;
+      }
+      return &frameBuffer[0];
+    }
+
+    const DcmIODTypes::Frame *frame = segdoc->getFrame(frameId);
+    if(!frame || frame->length < frameLength){
+      cerr << "ERROR: Frame " << frameId << " is missing or shorter than expected!" << endl;
+      throw -1;
+    }
+    return frame->pixData;
+  }
+
+  bool ImageSEGConverter::expandSlices(DcmSegmentation *segdoc, FrameReader &frameReader, bool binary,
+                                       size_t frameSize, const vector<SliceFrames> &sliceFrames,
+                                       ShortPixelType *imageBuffer, unsigned numberOfThreads) {
+    FrameDecodeTask frameDecodeTask(segdoc, frameReader, binary, frameSize, sliceFrames, imageBuffer);
+    if(!WorkerPool::run(frameDecodeTask, sliceFrames.size(), numberOfThreads)){
+      cerr << "ERROR: Failed to decode segmentation frames!" << endl;
+      throw -1;
+    }
+    return frameDecodeTask.hasOverlap();
+  }
+
+  template<class TImage>
+  typename TImage::Pointer ImageSEGConverter::createSegmentImage(const ShortImageType::Pointer &referenceImage,
+                                                                 const ShortImageType::RegionType &region) {
+    ShortImageType::PointType origin;
+    referenceImage->TransformIndexToPhysicalPoint(region.GetIndex(), origin);
+
+    typename TImage::RegionType imageRegion;
+    imageRegion.SetSize(region.GetSize());
+    typename TImage::Pointer segmentImage = TImage::New();
+    segmentImage->SetRegions(imageRegion);
+    segmentImage->SetOrigin(origin);
+    segmentImage->SetSpacing(referenceImage->GetSpacing());
+    segmentImage->SetDirection(referenceImage->GetDirection());
+    segmentImage->Allocate();
+    segmentImage->FillBuffer(0);
+    return segmentImage;
+  }
+
+  DcmSegmentation* ImageSEGConverter::loadSegmentation(DcmDataset *segDataset, FrameReader &frameReader,
+                                                      const set<unsigned> &segmentNumbers,
+                                                      unsigned firstSlice, unsigned &lastSlice,
+                                                      ShortImageType::Pointer &segImage,
+                                                      ShortImageType::RegionType &imageRegion,
+                                                      map<unsigned, vector<size_t> > &segment2frames,
+                                                      vector<unsigned> &frameSlices,
+                                                      JSONSegmentationMetaInformationHandler &metaInfo) {
 
     DcmRLEDecoderRegistration::registerCodecs();
 
     OFLogger dcemfinfLogger = OFLog::getLogger("qiicr.apps");
     dcemfinfLogger.setLogLevel(dcmtk::log4cplus::OFF_LOG_LEVEL);
 
+    // Load the segmentation without pixel data if possible, and read the frames
+    //  only when they are needed
+    if(!frameReader.detach())
+      cerr << "WARNING: Pixel data cannot be read frame by frame, loading all of the frames" << endl;
     DcmSegmentation *segdoc = NULL;
     OFCondition cond = DcmSegmentation::loadDataset(*segDataset, segdoc);
+    if(!segdoc && frameReader.isDetached()){
+      cerr << "WARNING: Failed to load the segmentation without its pixel data (" << cond.text() <<
+      "), loading all of the frames" << endl;
+      frameReader.attach();
+      cond = DcmSegmentation::loadDataset(*segDataset, segdoc);
+    }
     if(!segdoc){
       cerr << "ERROR: Failed to load segmentation dataset! " << cond.text() << endl;
       throw -1;
     }
+    // released to the caller once the segmentation is validated
+    OFunique_ptr<DcmSegmentation> segdocHolder(segdoc);
 
     // Directions
     FGInterface &fgInterface = segdoc->getFunctionalGroups();
@@ -484,13 +1176,10 @@ namespace dcmqi {
 
     // Spacing and origin
     double computedSliceSpacing, computedVolumeExtent;
-    vnl_vector<double> sliceDirection(3);
-    sliceDirection[0] = direction[0][2];
-    sliceDirection[1] = direction[1][2];
-    sliceDirection[2] = direction[2][2];
 
     ShortImageType::PointType imageOrigin;
-    if(computeVolumeExtent(fgInterface, sliceDirection, imageOrigin, computedSliceSpacing, computedVolumeExtent)){
+    FrameGeometry frameGeometry;
+    if(computeVolumeExtent(fgInterface, imageOrigin, computedSliceSpacing, computedVolumeExtent, frameGeometry)){
       cerr << "ERROR: Failed to compute origin and/or slice spacing!" << endl;
       throw -1;
     }
@@ -521,38 +1210,35 @@ namespace dcmqi {
     // number of slices should be computed, since segmentation may have empty frames
     imageSize[2] = ceil(computedVolumeExtent/imageSpacing[2])+1;
 
-    // Initialize the image
-    ShortImageType::RegionType imageRegion;
+    // Initialize the geometry of the output; the pixel buffer is only allocated
+    //  for the images that are actually returned
     imageRegion.SetSize(imageSize);
-    ShortImageType::Pointer segImage = ShortImageType::New();
+    segImage = ShortImageType::New();
     segImage->SetRegions(imageRegion);
     segImage->SetOrigin(imageOrigin);
     segImage->SetSpacing(imageSpacing);
     segImage->SetDirection(direction);
-    segImage->Allocate();
-    segImage->FillBuffer(0);
-
-    // ITK images corresponding to the individual segments
-    map<unsigned,ShortImageType::Pointer> segment2image;
-
-    // Iterate over frames, find the matching slice for each of the frames based on
-    // ImagePositionPatient, set non-zero pixels to the segment number. Notify
-    // about pixels that are initialized more than once.
 
-    DcmIODTypes::Frame *unpackedFrame = NULL;
+    // restrict the output to the requested range of slices
+    if(firstSlice >= imageSize[2] || firstSlice > lastSlice){
+      cerr << "ERROR: Requested slice range " << firstSlice << "-" << lastSlice <<
+      " is outside of the " << imageSize[2] << " slices of the segmentation!" << endl;
+      throw -1;
+    }
+    lastSlice = min(lastSlice, unsigned(imageSize[2]-1));
+    imageRegion.SetIndex(2, firstSlice);
+    imageRegion.SetSize(2, lastSlice-firstSlice+1);
 
-    JSONSegmentationMetaInformationHandler metaInfo;
+    // Iterate over frames, look up the slice of each of the frames, and group the
+    // frames by segment. Only the functional groups are needed for this, pixel data
+    // is not touched yet.
+    frameSlices = getFrameSlices(frameGeometry, segImage);
 
     populateMetaInformationFromDICOM(segDataset, segdoc, metaInfo);
 
     for(size_t frameId=0;frameId<fgInterface.getNumberOfFrames();frameId++){
-      const DcmIODTypes::Frame *frame = segdoc->getFrame(frameId);
       bool isPerFrame;
 
-      FGPlanePosPatient *planposfg =
-          OFstatic_cast(FGPlanePosPatient*,fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-      assert(planposfg);
-
 #ifndef NDEBUG
       FGFrameContent *fracon =
           OFstatic_cast(FGFrameContent*,fgInterface.get(frameId, DcmFGTypes::EFG_FRAMECONTENT, isPerFrame));
@@ -576,158 +1262,361 @@ namespace dcmqi {
         throw -1;
       }
 
-      if(segment2image.find(segmentId) == segment2image.end()){
-        typedef itk::ImageDuplicator<ShortImageType> DuplicatorType;
-        DuplicatorType::Pointer dup = DuplicatorType::New();
-        dup->SetInputImage(segImage);
-        dup->Update();
-        ShortImageType::Pointer newSegmentImage = dup->GetOutput();
-        newSegmentImage->FillBuffer(0);
-        segment2image[segmentId] = newSegmentImage;
+      if(!segmentNumbers.empty() && !segmentNumbers.count(segmentId))
+        continue;
+
+      if(frameSlices[frameId] < firstSlice || frameSlices[frameId] > lastSlice)
+        continue;
+
+      segment2frames[segmentId].push_back(frameId);
+    }
+
+    // populate meta information needed for Slicer ScalarVolumeNode initialization
+    //  (for example), once for every segment that has frames to decode
+    for(map<unsigned, vector<size_t> >::iterator sI=segment2frames.begin();sI!=segment2frames.end();){
+      // NOTE: according to the standard, segment numbering should start from 1,
+      //  not clear if this is intentional behavior or a bug in DCMTK expecting
+      //  it to start from 0
+      DcmSegment* segment = segdoc->getSegment(sI->first);
+      if(segment == NULL){
+        // same as before the frames were grouped: the segment is returned as an
+        //  empty image, without meta information
+        cerr << "Failed to get segment for segment ID " << sI->first << endl;
+        sI->second.clear();
+        ++sI;
+        continue;
       }
+      populateSegmentAttributes(segment, sI->first, metaInfo);
+      ++sI;
+    }
 
-      // populate meta information needed for Slicer ScalarVolumeNode initialization
-      //  (for example)
-      {
-        // NOTE: according to the standard, segment numbering should start from 1,
-        //  not clear if this is intentional behavior or a bug in DCMTK expecting
-        //  it to start from 0
+    for(set<unsigned>::const_iterator sI=segmentNumbers.begin();sI!=segmentNumbers.end();++sI)
+      if(segment2frames.find(*sI) == segment2frames.end())
+        cerr << "WARNING: No frames found for the requested segment " << *sI << endl;
 
-        DcmSegment* segment = segdoc->getSegment(segmentId);
-        if(segment == NULL){
-          cerr << "Failed to get segment for segment ID " << segmentId << endl;
-          continue;
-        }
+    return segdocHolder.release();
+  }
 
-        // get CIELab color for the segment
-        Uint16 ciedcm[3];
-        unsigned cielabScaled[3];
-        float cielab[3], ciexyz[3];
-        unsigned rgb[3];
-        if(segment->getRecommendedDisplayCIELabValue(
-            ciedcm[0], ciedcm[1], ciedcm[2]
-        ).bad()) {
-          // NOTE: if the call above fails, it overwrites the values anyway,
-          //  not sure if this is a dcmtk bug or not
-          ciedcm[0] = 43803;
-          ciedcm[1] = 26565;
-          ciedcm[2] = 37722;
-          cerr << "Failed to get CIELab values - initializing to default " <<
-          ciedcm[0] << "," << ciedcm[1] << "," << ciedcm[2] << endl;
-        }
-        cielabScaled[0] = unsigned(ciedcm[0]);
-        cielabScaled[1] = unsigned(ciedcm[1]);
-        cielabScaled[2] = unsigned(ciedcm[2]);
+  pair <map<unsigned,ShortImageType::Pointer>, string> ImageSEGConverter::dcmSegmentation2itkimage(DcmDataset *segDataset,
+                                                                                                bool mergeSegments,
+                                                                                                const set<unsigned> &segmentNumbers,
+                                                                                                unsigned firstSlice,
+                                                                                                unsigned lastSlice,
+                                                                                                unsigned numberOfThreads) {
+    SegmentImageCollector collector;
+    string metaInfo = dcmSegmentation2itkimage(segDataset, collector, mergeSegments,
+                                               segmentNumbers, firstSlice, lastSlice, numberOfThreads);
+    return pair <map<unsigned,ShortImageType::Pointer>, string>(collector.segment2image, metaInfo);
+  }
 
-        dcmqi::Helper::getCIELabFromIntegerScaledCIELab(&cielabScaled[0],&cielab[0]);
-        dcmqi::Helper::getCIEXYZFromCIELab(&cielab[0],&ciexyz[0]);
-        dcmqi::Helper::getRGBFromCIEXYZ(&ciexyz[0],&rgb[0]);
+  string ImageSEGConverter::dcmSegmentation2itkimage(DcmDataset *segDataset, SegmentImageVisitor &visitor,
+                                                     bool mergeSegments, const set<unsigned> &segmentNumbers,
+                                                     unsigned firstSlice, unsigned lastSlice,
+                                                     unsigned numberOfThreads) {
 
-        SegmentAttributes* segmentAttributes = metaInfo.createAndGetNewSegment(segmentId);
+    // The pixel data element is put back into the dataset when frameReader goes out of scope
+    FrameReader frameReader(segDataset, DCM_PixelData);
+    ShortImageType::Pointer segImage;
+    ShortImageType::RegionType imageRegion;
+    map<unsigned, vector<size_t> > segment2frames;
+    vector<unsigned> frameSlices;
+    JSONSegmentationMetaInformationHandler metaInfo;
+    DcmSegmentation *segdoc = loadSegmentation(segDataset, frameReader, segmentNumbers, firstSlice, lastSlice,
+                                               segImage, imageRegion, segment2frames, frameSlices, metaInfo);
+    OFunique_ptr<DcmSegmentation> segdocHolder(segdoc);
+    const ShortImageType::SizeType imageSize = segImage->GetLargestPossibleRegion().GetSize();
+
+    const bool binary = segdoc->getSegmentationType() == DcmSegTypes::ST_BINARY;
+    const size_t frameSize = imageSize[0]*imageSize[1];
+    vector<Uint8> frameBuffer;
+
+    numberOfThreads = WorkerPool::getNumberOfThreads(numberOfThreads);
+    const size_t numSlices = lastSlice-firstSlice+1;
+
+    // ITK images corresponding to the individual segments are handed over to the
+    //  visitor as soon as they are complete, and are not referenced afterwards
+    if(mergeSegments){
+      // a single label map holding all of the segments, which is only possible
+      //  as long as no pixel belongs to more than one segment
+      ShortImageType::Pointer labelImage = createSegmentImage<ShortImageType>(segImage, imageRegion);
+      vector<SliceFrames> sliceFrames(numSlices);
+      for(map<unsigned, vector<size_t> >::const_iterator sI=segment2frames.begin();sI!=segment2frames.end();++sI){
+        for(size_t i=0;i<sI->second.size();i++){
+          const size_t frameId = sI->second[i];
+          sliceFrames[frameSlices[frameId]-firstSlice].push_back(make_pair(frameId, ShortPixelType(sI->first)));
+        }
+      }
+      const bool overlap = expandSlices(segdoc, frameReader, binary, frameSize, sliceFrames,
+                                        labelImage->GetBufferPointer(), numberOfThreads);
 
-        if (segmentAttributes) {
-          segmentAttributes->setLabelID(segmentId);
-          DcmSegTypes::E_SegmentAlgoType algorithmType = segment->getSegmentAlgorithmType();
-          string readableAlgorithmType = DcmSegTypes::algoType2OFString(algorithmType).c_str();
-          segmentAttributes->setSegmentAlgorithmType(readableAlgorithmType);
+      if(!overlap){
+        visitor.visit(0, labelImage);
+        return metaInfo.getJSONOutputAsString();
+      }
 
-          if (algorithmType == DcmSegTypes::SAT_UNKNOWN) {
-            cerr << "ERROR: AlgorithmType is not valid with value " << readableAlgorithmType << endl;
-            throw -1;
+      cerr << "WARNING: Segments overlap and cannot be merged into a single label map," <<
+      " each segment will be cropped to its bounding box instead." << endl;
+      labelImage = NULL;
+
+      for(map<unsigned, vector<size_t> >::const_iterator sI=segment2frames.begin();sI!=segment2frames.end();++sI){
+        // xmin, xmax, ymin, ymax, zmin, zmax of the non-empty frames of the segment
+        unsigned bbox[6];
+        bool nonEmpty = false;
+        for(size_t i=0;i<sI->second.size();i++){
+          const size_t frameId = sI->second[i];
+          unsigned frameBBox[4];
+          const Uint8 *frameData = getFrameData(segdoc, frameReader, frameId, binary, frameSize, frameBuffer);
+          if(!getFrameBoundingBox(frameData, binary, imageSize[0], imageSize[1], frameBBox))
+            continue;
+          if(!nonEmpty){
+            copy(frameBBox, frameBBox+4, bbox);
+            bbox[4] = bbox[5] = frameSlices[frameId];
+            nonEmpty = true;
+          } else {
+            bbox[0] = min(bbox[0], frameBBox[0]);
+            bbox[1] = max(bbox[1], frameBBox[1]);
+            bbox[2] = min(bbox[2], frameBBox[2]);
+            bbox[3] = max(bbox[3], frameBBox[3]);
+            bbox[4] = min(bbox[4], frameSlices[frameId]);
+            bbox[5] = max(bbox[5], frameSlices[frameId]);
           }
-          if (algorithmType != DcmSegTypes::SAT_MANUAL) {
-            OFString segmentAlgorithmName;
-            segment->getSegmentAlgorithmName(segmentAlgorithmName);
-            if(segmentAlgorithmName.length() > 0)
-              segmentAttributes->setSegmentAlgorithmName(segmentAlgorithmName.c_str());
+        }
+        if(!nonEmpty){
+          // keep a single voxel for the segments without any pixels
+          bbox[0] = bbox[1] = bbox[2] = bbox[3] = 0;
+          bbox[4] = bbox[5] = sI->second.empty() ? firstSlice : frameSlices[sI->second[0]];
+        }
+
+        ShortImageType::RegionType segmentRegion;
+        for(int j=0;j<3;j++){
+          segmentRegion.SetIndex(j, bbox[2*j]);
+          segmentRegion.SetSize(j, bbox[2*j+1]-bbox[2*j]+1);
+        }
+        ShortImageType::Pointer segmentImage = createSegmentImage<ShortImageType>(segImage, segmentRegion);
+        const size_t segmentFrameSize = segmentRegion.GetSize(0)*segmentRegion.GetSize(1);
+
+        if(nonEmpty){
+          for(size_t i=0;i<sI->second.size();i++){
+            const size_t frameId = sI->second[i];
+            const Uint8 *frameData = getFrameData(segdoc, frameReader, frameId, binary, frameSize, frameBuffer);
+            expandFrameRegion(frameData, binary, imageSize[0], bbox, sI->first,
+                              segmentImage->GetBufferPointer() + (frameSlices[frameId]-bbox[4])*segmentFrameSize);
           }
+        }
+        visitor.visit(sI->first, segmentImage);
+      }
+    } else {
+      for(map<unsigned, vector<size_t> >::const_iterator sI=segment2frames.begin();sI!=segment2frames.end();++sI){
+        ShortImageType::Pointer segmentImage = createSegmentImage<ShortImageType>(segImage, imageRegion);
+        // write the frame content straight into the buffer of the segment image
+        vector<SliceFrames> sliceFrames(numSlices);
+        for(size_t i=0;i<sI->second.size();i++){
+          const size_t frameId = sI->second[i];
+          sliceFrames[frameSlices[frameId]-firstSlice].push_back(make_pair(frameId, ShortPixelType(sI->first)));
+        }
+        expandSlices(segdoc, frameReader, binary, frameSize, sliceFrames, segmentImage->GetBufferPointer(),
+                     numberOfThreads);
+        visitor.visit(sI->first, segmentImage);
+      }
+    }
 
-          OFString segmentDescription, segmentLabel, trackingIdentifier, trackingUniqueIdentifier;
+    return metaInfo.getJSONOutputAsString();
+  }
 
-          segment->getSegmentDescription(segmentDescription);
-          segmentAttributes->setSegmentDescription(segmentDescription.c_str());
+  string ImageSEGConverter::dcmFractionalSegmentation2itkimage(DcmDataset *segDataset,
+                                                               FractionalSegmentImageVisitor &visitor,
+                                                               bool probabilities,
+                                                               const set<unsigned> &segmentNumbers,
+                                                               unsigned firstSlice, unsigned lastSlice,
+                                                               unsigned numberOfThreads) {
+    // The pixel data element is put back into the dataset when frameReader goes out of scope
+    FrameReader frameReader(segDataset, DCM_PixelData);
+    ShortImageType::Pointer segImage;
+    ShortImageType::RegionType imageRegion;
+    map<unsigned, vector<size_t> > segment2frames;
+    vector<unsigned> frameSlices;
+    JSONSegmentationMetaInformationHandler metaInfo;
+    DcmSegmentation *segdoc = loadSegmentation(segDataset, frameReader, segmentNumbers, firstSlice, lastSlice,
+                                               segImage, imageRegion, segment2frames, frameSlices, metaInfo);
+    OFunique_ptr<DcmSegmentation> segdocHolder(segdoc);
+    checkFractionalSegmentation(segdoc);
+    const Uint16 maximumFractionalValue = getMaximumFractionalValue(segDataset);
+    const size_t frameSize = imageRegion.GetSize(0)*imageRegion.GetSize(1);
+
+    numberOfThreads = WorkerPool::getNumberOfThreads(numberOfThreads);
+    const size_t numSlices = lastSlice-firstSlice+1;
+
+    for(map<unsigned, vector<size_t> >::const_iterator sI=segment2frames.begin();sI!=segment2frames.end();++sI){
+      vector<SliceFrames> sliceFrames(numSlices);
+      for(size_t i=0;i<sI->second.size();i++){
+        const size_t frameId = sI->second[i];
+        sliceFrames[frameSlices[frameId]-firstSlice].push_back(make_pair(frameId, ShortPixelType(sI->first)));
+      }
 
-          segment->getSegmentLabel(segmentLabel);
-          segmentAttributes->setSegmentLabel(segmentLabel.c_str());
+      // the frames are written straight into the buffer of the segment image
+      ProbabilityImageType::Pointer probabilityImage;
+      FractionalImageType::Pointer fractionalImage;
+      if(probabilities)
+        probabilityImage = createSegmentImage<ProbabilityImageType>(segImage, imageRegion);
+      else
+        fractionalImage = createSegmentImage<FractionalImageType>(segImage, imageRegion);
+      FractionalFrameDecodeTask frameDecodeTask(segdoc, frameReader, frameSize, sliceFrames,
+          probabilities ? probabilityImage->GetBufferPointer() : NULL, 1.f/maximumFractionalValue,
+          probabilities ? NULL : fractionalImage->GetBufferPointer(), NULL);
+      if(!WorkerPool::run(frameDecodeTask, numSlices, numberOfThreads)){
+        cerr << "ERROR: Failed to decode the frames of segment " << sI->first << endl;
+        throw -1;
+      }
 
-          segment->getTrackingID(trackingIdentifier);
-          segment->getTrackingUID(trackingUniqueIdentifier);
+      if(probabilities)
+        visitor.visit(sI->first, probabilityImage);
+      else
+        visitor.visit(sI->first, fractionalImage);
+    }
 
-          if (trackingIdentifier.length() > 0) {
-              segmentAttributes->setTrackingIdentifier(trackingIdentifier.c_str());
-          }
-          if (trackingUniqueIdentifier.length() > 0) {
-              segmentAttributes->setTrackingUniqueIdentifier(trackingUniqueIdentifier.c_str());
-          }
+    return metaInfo.getJSONOutputAsString();
+  }
 
-          segmentAttributes->setRecommendedDisplayRGBValue(rgb[0], rgb[1], rgb[2]);
-          segmentAttributes->setSegmentedPropertyCategoryCodeSequence(segment->getSegmentedPropertyCategoryCode());
-            segmentAttributes->setSegmentedPropertyTypeCodeSequence(segment->getSegmentedPropertyTypeCode());
+  string ImageSEGConverter::dcmFractionalSegmentation2labelmap(DcmDataset *segDataset, SegmentImageVisitor &visitor,
+                                                               const set<unsigned> &segmentNumbers,
+                                                               unsigned firstSlice, unsigned lastSlice,
+                                                               unsigned numberOfThreads) {
+    // The pixel data element is put back into the dataset when frameReader goes out of scope
+    FrameReader frameReader(segDataset, DCM_PixelData);
+    ShortImageType::Pointer segImage;
+    ShortImageType::RegionType imageRegion;
+    map<unsigned, vector<size_t> > segment2frames;
+    vector<unsigned> frameSlices;
+    JSONSegmentationMetaInformationHandler metaInfo;
+    DcmSegmentation *segdoc = loadSegmentation(segDataset, frameReader, segmentNumbers, firstSlice, lastSlice,
+                                               segImage, imageRegion, segment2frames, frameSlices, metaInfo);
+    OFunique_ptr<DcmSegmentation> segdocHolder(segdoc);
+    // the label map only compares the stored values, MaximumFractionalValue is not needed
+    checkFractionalSegmentation(segdoc);
+    const size_t frameSize = imageRegion.GetSize(0)*imageRegion.GetSize(1);
+
+    numberOfThreads = WorkerPool::getNumberOfThreads(numberOfThreads);
+    const size_t numSlices = lastSlice-firstSlice+1;
+
+    // all segments are decoded slice by slice, in the order of the segment numbers
+    vector<SliceFrames> sliceFrames(numSlices);
+    for(map<unsigned, vector<size_t> >::const_iterator sI=segment2frames.begin();sI!=segment2frames.end();++sI){
+      for(size_t i=0;i<sI->second.size();i++){
+        const size_t frameId = sI->second[i];
+        sliceFrames[frameSlices[frameId]-firstSlice].push_back(make_pair(frameId, ShortPixelType(sI->first)));
+      }
+    }
 
-          if (segment->getSegmentedPropertyTypeModifierCode().size() > 0) {
-              segmentAttributes->setSegmentedPropertyTypeModifierCodeSequence(
-                      segment->getSegmentedPropertyTypeModifierCode()[0]);
-          }
+    ShortImageType::Pointer labelImage = createSegmentImage<ShortImageType>(segImage, imageRegion);
+    FractionalFrameDecodeTask frameDecodeTask(segdoc, frameReader, frameSize, sliceFrames, NULL, 0, NULL,
+                                              labelImage->GetBufferPointer());
+    if(!WorkerPool::run(frameDecodeTask, numSlices, numberOfThreads)){
+      cerr << "ERROR: Failed to decode segmentation frames!" << endl;
+      throw -1;
+    }
+    visitor.visit(0, labelImage);
 
-          GeneralAnatomyMacro &anatomyMacro = segment->getGeneralAnatomyCode();
-          CodeSequenceMacro& anatomicRegionSequence = anatomyMacro.getAnatomicRegion();
-          if (anatomicRegionSequence.check(true).good()) {
-              segmentAttributes->setAnatomicRegionSequence(anatomyMacro.getAnatomicRegion());
-          }
-          if (anatomyMacro.getAnatomicRegionModifier().size() > 0) {
-              segmentAttributes->setAnatomicRegionModifierSequence(*(anatomyMacro.getAnatomicRegionModifier()[0]));
-          }
-        }
-      }
+    return metaInfo.getJSONOutputAsString();
+  }
 
-      // get string representation of the frame origin
-      ShortImageType::PointType frameOriginPoint;
-      ShortImageType::IndexType frameOriginIndex;
-      for(int j=0;j<3;j++){
-        OFString planposStr;
-        if(planposfg->getImagePositionPatient(planposStr, j).good()){
-          frameOriginPoint[j] = atof(planposStr.c_str());
-        }
-      }
+  void ImageSEGConverter::checkFractionalSegmentation(DcmSegmentation *segdoc) {
+    if(segdoc->getSegmentationType() != DcmSegTypes::ST_FRACTIONAL){
+      cerr << "ERROR: Segmentation is not FRACTIONAL!" << endl;
+      throw -1;
+    }
+  }
 
-      if(!segment2image[segmentId]->TransformPhysicalPointToIndex(frameOriginPoint, frameOriginIndex)){
-        cerr << "ERROR: Frame " << frameId << " origin " << frameOriginPoint <<
-        " is outside image geometry!" << frameOriginIndex << endl;
-        cerr << "Image size: " << segment2image[segmentId]->GetBufferedRegion().GetSize() << endl;
+  Uint16 ImageSEGConverter::getMaximumFractionalValue(DcmDataset *segDataset) {
+    Uint16 maximumFractionalValue = 0;
+    if(segDataset->findAndGetUint16(DCM_MaximumFractionalValue, maximumFractionalValue).bad() ||
+       !maximumFractionalValue){
+      cerr << "ERROR: MaximumFractionalValue is missing or 0!" << endl;
+      throw -1;
+    }
+    return maximumFractionalValue;
+  }
+
+  void ImageSEGConverter::populateSegmentAttributes(DcmSegment *segment, unsigned segmentId,
+                                                    JSONSegmentationMetaInformationHandler &metaInfo) {
+    // get CIELab color for the segment
+    Uint16 ciedcm[3];
+    unsigned cielabScaled[3];
+    float cielab[3], ciexyz[3];
+    unsigned rgb[3];
+    if(segment->getRecommendedDisplayCIELabValue(
+        ciedcm[0], ciedcm[1], ciedcm[2]
+    ).bad()) {
+      // NOTE: if the call above fails, it overwrites the values anyway,
+      //  not sure if this is a dcmtk bug or not
+      ciedcm[0] = 43803;
+      ciedcm[1] = 26565;
+      ciedcm[2] = 37722;
+      cerr << "Failed to get CIELab values - initializing to default " <<
+      ciedcm[0] << "," << ciedcm[1] << "," << ciedcm[2] << endl;
+    }
+    cielabScaled[0] = unsigned(ciedcm[0]);
+    cielabScaled[1] = unsigned(ciedcm[1]);
+    cielabScaled[2] = unsigned(ciedcm[2]);
+
+    dcmqi::Helper::getCIELabFromIntegerScaledCIELab(&cielabScaled[0],&cielab[0]);
+    dcmqi::Helper::getCIEXYZFromCIELab(&cielab[0],&ciexyz[0]);
+    dcmqi::Helper::getRGBFromCIEXYZ(&ciexyz[0],&rgb[0]);
+
+    SegmentAttributes* segmentAttributes = metaInfo.createAndGetNewSegment(segmentId);
+
+    if (segmentAttributes) {
+      segmentAttributes->setLabelID(segmentId);
+      DcmSegTypes::E_SegmentAlgoType algorithmType = segment->getSegmentAlgorithmType();
+      string readableAlgorithmType = DcmSegTypes::algoType2OFString(algorithmType).c_str();
+      segmentAttributes->setSegmentAlgorithmType(readableAlgorithmType);
+
+      if (algorithmType == DcmSegTypes::SAT_UNKNOWN) {
+        cerr << "ERROR: AlgorithmType is not valid with value " << readableAlgorithmType << endl;
         throw -1;
       }
+      if (algorithmType != DcmSegTypes::SAT_MANUAL) {
+        OFString segmentAlgorithmName;
+        segment->getSegmentAlgorithmName(segmentAlgorithmName);
+        if(segmentAlgorithmName.length() > 0)
+          segmentAttributes->setSegmentAlgorithmName(segmentAlgorithmName.c_str());
+      }
 
-      unsigned slice = frameOriginIndex[2];
+      OFString segmentDescription, segmentLabel, trackingIdentifier, trackingUniqueIdentifier;
 
-      if(segdoc->getSegmentationType() == DcmSegTypes::ST_BINARY)
-        unpackedFrame = DcmSegUtils::unpackBinaryFrame(frame,
-                                 imageSize[1], // Rows
-                                 imageSize[0]); // Cols
-      else
-        unpackedFrame = new DcmIODTypes::Frame(*frame);
-
-      // initialize slice with the frame content
-      for(unsigned row=0;row<imageSize[1];row++){
-        for(unsigned col=0;col<imageSize[0];col++){
-          ShortImageType::PixelType pixel;
-          unsigned bitCnt = row*imageSize[0]+col;
-          pixel = unpackedFrame->pixData[bitCnt];
-
-          if(pixel!=0){
-            ShortImageType::IndexType index;
-            index[0] = col;
-            index[1] = row;
-            index[2] = slice;
-            segment2image[segmentId]->SetPixel(index, segmentId);
-          }
-        }
+      segment->getSegmentDescription(segmentDescription);
+      segmentAttributes->setSegmentDescription(segmentDescription.c_str());
+
+      segment->getSegmentLabel(segmentLabel);
+      segmentAttributes->setSegmentLabel(segmentLabel.c_str());
+
+      segment->getTrackingID(trackingIdentifier);
+      segment->getTrackingUID(trackingUniqueIdentifier);
+
+      if (trackingIdentifier.length() > 0) {
+          segmentAttributes->setTrackingIdentifier(trackingIdentifier.c_str());
+      }
+      if (trackingUniqueIdentifier.length() > 0) {
+          segmentAttributes->setTrackingUniqueIdentifier(trackingUniqueIdentifier.c_str());
       }
 
-      if(unpackedFrame != NULL)
-        delete unpackedFrame;
-    }
+      segmentAttributes->setRecommendedDisplayRGBValue(rgb[0], rgb[1], rgb[2]);
+      segmentAttributes->setSegmentedPropertyCategoryCodeSequence(segment->getSegmentedPropertyCategoryCode());
+        segmentAttributes->setSegmentedPropertyTypeCodeSequence(segment->getSegmentedPropertyTypeCode());
 
-    return pair <map<unsigned,ShortImageType::Pointer>, string>(segment2image, metaInfo.getJSONOutputAsString());
+      if (segment->getSegmentedPropertyTypeModifierCode().size() > 0) {
+          segmentAttributes->setSegmentedPropertyTypeModifierCodeSequence(
+                  segment->getSegmentedPropertyTypeModifierCode()[0]);
+      }
+
+      GeneralAnatomyMacro &anatomyMacro = segment->getGeneralAnatomyCode();
+      CodeSequenceMacro& anatomicRegionSequence = anatomyMacro.getAnatomicRegion();
+      if (anatomicRegionSequence.check(true).good()) {
+          segmentAttributes->setAnatomicRegionSequence(anatomyMacro.getAnatomicRegion());
+      }
+      if (anatomyMacro.getAnatomicRegionModifier().size() > 0) {
+          segmentAttributes->setAnatomicRegionModifierSequence(*(anatomyMacro.getAnatomicRegionModifier()[0]));
+      }
+    }
   }
 
   void ImageSEGConverter::populateMetaInformationFromDICOM(DcmDataset *segDataset, DcmSegmentation *segdoc,
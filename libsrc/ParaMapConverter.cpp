@@ -7,6 +7,9 @@
 #include "dcmqi/ParaMapConverter.h"
 #include "dcmqi/ImageSEGConverter.h"
 
+// STD includes
+#include <cstring>
+
 using namespace std;
 
 namespace dcmqi {
@@ -73,14 +76,15 @@ namespace dcmqi {
       FGPixelMeasures *pixmsr = new FGPixelMeasures();
 
       FloatImageType::SpacingType labelSpacing = parametricMapImage->GetSpacing();
-      ostringstream spacingSStream;
-      spacingSStream << scientific << labelSpacing[0] << "\\" << labelSpacing[1];
-      CHECK_COND(pixmsr->setPixelSpacing(spacingSStream.str().c_str()));
-
-      spacingSStream.clear(); spacingSStream.str("");
-      spacingSStream << scientific << labelSpacing[2];
-      CHECK_COND(pixmsr->setSpacingBetweenSlices(spacingSStream.str().c_str()));
-      CHECK_COND(pixmsr->setSliceThickness(spacingSStream.str().c_str()));
+      char pixelSpacing[2*Helper::DecimalStringBufferSize], sliceSpacing[Helper::DecimalStringBufferSize];
+      Helper::floatToDecimalString(labelSpacing[0], pixelSpacing);
+      strcat(pixelSpacing, "\\");
+      Helper::floatToDecimalString(labelSpacing[1], pixelSpacing+strlen(pixelSpacing));
+      CHECK_COND(pixmsr->setPixelSpacing(pixelSpacing));
+
+      Helper::floatToDecimalString(labelSpacing[2], sliceSpacing);
+      CHECK_COND(pixmsr->setSpacingBetweenSlices(sliceSpacing));
+      CHECK_COND(pixmsr->setSliceThickness(sliceSpacing));
       CHECK_COND(pMapDoc->addForAllFrames(*pixmsr));
     }
 
@@ -92,14 +96,12 @@ namespace dcmqi {
 
       cout << "Directions: " << labelDirMatrix << endl;
 
+      char orientation[6][Helper::DecimalStringBufferSize];
+      for(int j=0;j<6;j++)
+        Helper::floatToDecimalString(labelDirMatrix[j%3][j/3], orientation[j]);
       FGPlaneOrientationPatient *planor =
           FGPlaneOrientationPatient::createMinimal(
-              Helper::floatToStrScientific(labelDirMatrix[0][0]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[1][0]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[2][0]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[0][1]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[1][1]).c_str(),
-              Helper::floatToStrScientific(labelDirMatrix[2][1]).c_str());
+              orientation[0], orientation[1], orientation[2], orientation[3], orientation[4], orientation[5]);
 
       //CHECK_COND(planor->setImageOrientationPatient(imageOrientationPatientStr));
       CHECK_COND(pMapDoc->addForAllFrames(*planor));
@@ -230,16 +232,11 @@ namespace dcmqi {
     CHECK_COND(pMapDoc->addForAllFrames(rwvmFG));
 
     /* Map referenced instances to the ITK parametric map slices */
-    // this is a hack - the function below needs to be factored out
     vector<vector<int> > slice2derimg;
+    vector<vector<OFVector<Uint16> > > slice2frameNumbers;
     bool hasDerivationImages = false;
     {
-
-      typedef itk::CastImageFilter<FloatImageType,ShortImageType> CastFilterType;
-      CastFilterType::Pointer cast = CastFilterType::New();
-      cast->SetInput(parametricMapImage);
-      cast->Update();
-      slice2derimg = getSliceMapForSegmentation2DerivationImage(dcmDatasets, cast->GetOutput());
+      slice2derimg = getSliceMapForSegmentation2DerivationImage(dcmDatasets, parametricMapImage, &slice2frameNumbers);
       cout << "Mapping from the ITK image slices to the DICOM instances in the input list" << endl;
       for(size_t i=0;i<slice2derimg.size();i++){
         cout << "  Slice " << i << ": ";
@@ -257,9 +254,10 @@ namespace dcmqi {
 
     IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem* refseriesItem = new IODSeriesAndInstanceReferenceMacro::ReferencedSeriesItem;
 
-    OFVector<SOPInstanceReferenceMacro*> &refinstances = refseriesItem->getReferencedInstanceItems();
+    // source datasets referenced by the frames, added to the common instance references at the end
+    set<int> referencedDatasetIds;
 
-    OFString seriesInstanceUID, classUID;
+    OFString seriesInstanceUID;
 
     CHECK_COND(dcmDatasets[0]->findAndGetOFString(DCM_SeriesInstanceUID, seriesInstanceUID));
     CHECK_COND(refseriesItem->setSeriesInstanceUID(seriesInstanceUID));
@@ -274,6 +272,15 @@ namespace dcmqi {
     if(hasDerivationImages)
       perFrameFGs.push_back(fgder);
 
+    const size_t frameSize = inputSize[0] * inputSize[1];
+    DPMParametricMapIOD::FramesType framesVariant = pMapDoc->getFrames();
+    DPMParametricMapIOD::Frames<FloatPixelType> *frames =
+        OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&framesVariant);
+    if(!frames){
+      cerr << "ERROR: Failed to get frames of the parametric map!" << endl;
+      throw -1;
+    }
+
     for (unsigned long sliceNumber = 0; result.good() && (sliceNumber < inputSize[2]); sliceNumber++) {
 
       OFVector<DcmDataset*> siVector;
@@ -283,12 +290,8 @@ namespace dcmqi {
         siVector.push_back(dcmDatasets[slice2derimg[sliceNumber][derImageInstanceNum]]);
       }
 
-      int uidfound = 0, uidnotfound = 0;
-
       if(siVector.size()>0){
 
-        set<OFString> instanceUIDs;
-
         DerivationImageItem *derimgItem;
 
         // TODO: I know David will not like this ...
@@ -311,67 +314,25 @@ namespace dcmqi {
         CHECK_COND(derimgItem->addSourceImageItems(siVector,
                                                  CodeSequenceMacro("121322","DCM","Source image for image processing operation"),
                                                  srcimgItems));
-
-        {
-          // initialize class UID and series instance UID
-          ImageSOPInstanceReferenceMacro &instRef = srcimgItems[0]->getImageSOPInstanceReference();
-          OFString instanceUID;
-
-          CHECK_COND(instRef.getReferencedSOPClassUID(classUID));
-          CHECK_COND(instRef.getReferencedSOPInstanceUID(instanceUID));
-
-          if(instanceUIDs.find(instanceUID) == instanceUIDs.end()){
-            SOPInstanceReferenceMacro *refinstancesItem = new SOPInstanceReferenceMacro();
-            CHECK_COND(refinstancesItem->setReferencedSOPClassUID(classUID));
-            CHECK_COND(refinstancesItem->setReferencedSOPInstanceUID(instanceUID));
-            refinstances.push_back(refinstancesItem);
-            instanceUIDs.insert(instanceUID);
-            uidnotfound++;
-          } else {
-            uidfound++;
-          }
-        }
-
+        setReferencedFrameNumbers(srcimgItems, slice2frameNumbers[sliceNumber]);
+        referencedDatasetIds.insert(slice2derimg[sliceNumber].begin(), slice2derimg[sliceNumber].end());
       }
 
 
-      //result = addFrame(*pMapDoc, parametricMapImage, metaInfo, sliceNumber, perFrameFGs);
-
       // addFrame
       {
-        FloatImageType::RegionType sliceRegion;
         FloatImageType::IndexType sliceIndex;
-        FloatImageType::SizeType inputSize = parametricMapImage->GetBufferedRegion().GetSize();
-
         sliceIndex[0] = 0;
         sliceIndex[1] = 0;
         sliceIndex[2] = sliceNumber;
 
-        inputSize[2] = 1;
-
-        sliceRegion.SetIndex(sliceIndex);
-        sliceRegion.SetSize(inputSize);
-
-        const unsigned frameSize = inputSize[0] * inputSize[1];
-
-        OFVector<IODFloatingPointImagePixelModule::value_type> data(frameSize);
-
-        itk::ImageRegionConstIteratorWithIndex<FloatImageType> sliceIterator(parametricMapImage, sliceRegion);
-
-        unsigned framePixelCnt = 0;
-        for(sliceIterator.GoToBegin();!sliceIterator.IsAtEnd(); ++sliceIterator, ++framePixelCnt){
-          data[framePixelCnt] = sliceIterator.Get();
-          FloatImageType::IndexType idx = sliceIterator.GetIndex();
-          //      cout << framePixelCnt << " " << idx[1] << "," << idx[0] << endl;
-        }
-
         // Plane Position
         FloatImageType::PointType sliceOriginPoint;
         parametricMapImage->TransformIndexToPhysicalPoint(sliceIndex, sliceOriginPoint);
-        fgppp->setImagePositionPatient(
-            Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
-            Helper::floatToStrScientific(sliceOriginPoint[1]).c_str(),
-            Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
+        char slicePosition[3][Helper::DecimalStringBufferSize];
+        for(int j=0;j<3;j++)
+          Helper::floatToDecimalString(sliceOriginPoint[j], slicePosition[j]);
+        fgppp->setImagePositionPatient(slicePosition[0], slicePosition[1], slicePosition[2]);
 
         // Frame Content
         OFCondition result = fgfc->setDimensionIndexValues(sliceNumber+1 /* value within dimension */, 0 /* first dimension */);
@@ -382,8 +343,10 @@ namespace dcmqi {
           // perFrameFGs.push_back(fgder);
 #endif
 
-        DPMParametricMapIOD::FramesType frames = pMapDoc->getFrames();
-        result = OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&frames)->addFrame(&*data.begin(), frameSize, perFrameFGs);
+        // the slice is contiguous in the ITK image buffer, pass it to the IOD as is;
+        //  the IOD keeps its own copy of the frame
+        CHECK_COND(frames->addFrame(parametricMapImage->GetBufferPointer() + sliceNumber*frameSize,
+                                    frameSize, perFrameFGs));
 
         cout << "Frame " << sliceNumber << " added" << endl;
       }
@@ -395,8 +358,10 @@ namespace dcmqi {
       }
     }
 
+    addReferencedInstances(dcmDatasets, referencedDatasetIds, *refseriesItem);
+
     // add ReferencedSeriesItem only if it is not empty
-    if(refinstances.size())
+    if(refseriesItem->getReferencedInstanceItems().size())
       refseries.push_back(refseriesItem);
 
     delete fgppp;
@@ -442,8 +407,21 @@ namespace dcmqi {
     OFLogger dcemfinfLogger = OFLog::getLogger("qiicr.apps");
     dcemfinfLogger.setLogLevel(dcmtk::log4cplus::OFF_LOG_LEVEL);
 
+    // Load the parametric map without pixel data if possible, and read the frames
+    //  only when they are needed. The pixel data element is put back into the
+    //  dataset when frameReader goes out of scope.
+    FrameReader frameReader(pmapDataset, DCM_FloatPixelData);
+    if(!frameReader.detach())
+      cerr << "WARNING: Pixel data cannot be read frame by frame, loading all of the frames" << endl;
     OFvariant<OFCondition,DPMParametricMapIOD*> result = DPMParametricMapIOD::loadDataset(*pmapDataset);
-    if (OFget<OFCondition>(&result)) {
+    if (OFget<OFCondition>(&result) && frameReader.isDetached()) {
+      cerr << "WARNING: Failed to load the parametric map without its pixel data (" <<
+      OFget<OFCondition>(&result)->text() << "), loading all of the frames" << endl;
+      frameReader.attach();
+      result = DPMParametricMapIOD::loadDataset(*pmapDataset);
+    }
+    if (OFCondition *cond = OFget<OFCondition>(&result)) {
+      cerr << "ERROR: Failed to load parametric map dataset! " << cond->text() << endl;
       throw -1;
     }
 
@@ -459,13 +437,10 @@ namespace dcmqi {
 
     // Spacing and origin
     double computedSliceSpacing, computedVolumeExtent;
-    vnl_vector<double> sliceDirection(3);
-    sliceDirection[0] = direction[0][2];
-    sliceDirection[1] = direction[1][2];
-    sliceDirection[2] = direction[2][2];
 
     FloatImageType::PointType imageOrigin;
-    if(computeVolumeExtent(fgInterface, sliceDirection, imageOrigin, computedSliceSpacing, computedVolumeExtent)){
+    FrameGeometry frameGeometry;
+    if(computeVolumeExtent(fgInterface, imageOrigin, computedSliceSpacing, computedVolumeExtent, frameGeometry)){
       cerr << "ERROR: Failed to compute origin and/or slice spacing!" << endl;
       throw -1;
     }
@@ -508,119 +483,60 @@ namespace dcmqi {
     pmImage->FillBuffer(0);
 
     JSONParametricMapMetaInformationHandler metaInfo;
-    populateMetaInformationFromDICOM(pmapDataset, metaInfo);
+    populateMetaInformationFromDICOM(pmapDataset, pMapDoc, metaInfo);
 
+    const size_t frameSize = imageSize[0]*imageSize[1];
+    DPMParametricMapIOD::Frames<FloatPixelType> *frames = NULL;
     DPMParametricMapIOD::FramesType obj = pMapDoc->getFrames();
-    if (OFget<OFCondition>(&obj)) {
-      throw -1;
+    if(!frameReader.isDetached()) {
+      frames = OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&obj);
+      if (!frames) {
+        throw -1;
+      }
     }
 
-    DPMParametricMapIOD::Frames<FloatPixelType> frames = *OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&obj);
+    // slice of every frame in the output image
+    const vector<unsigned> frameSlices = getFrameSlices(frameGeometry, pmImage);
+    vector<bool> sliceInitialized(imageSize[2], false);
 
     for(unsigned int frameId=0;frameId<fgInterface.getNumberOfFrames();frameId++){
 
-      FloatPixelType *frame = frames.getFrame(frameId);
-
+#ifndef NDEBUG
       bool isPerFrame;
-
-      FGPlanePosPatient *planposfg =
-          OFstatic_cast(FGPlanePosPatient*,fgInterface.get(frameId, DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
-      assert(planposfg);
-
       FGFrameContent *fracon =
           OFstatic_cast(FGFrameContent*,fgInterface.get(frameId, DcmFGTypes::EFG_FRAMECONTENT, isPerFrame));
       assert(fracon);
+#endif
 
-      // populate meta information needed for Slicer ScalarVolumeNode initialization
-      {
-      }
-
-      FloatImageType::IndexType index;
-      // initialize slice with the frame content
-      for(unsigned int row=0;row<imageSize[1];row++){
-        index[1] = row;
-        index[2] = frameId;
-        for(unsigned int col=0;col<imageSize[0];col++){
-          unsigned pixelPosition = row*imageSize[0] + col;
-          index[0] = col;
-          pmImage->SetPixel(index, frame[pixelPosition]);
+      // frames are not necessarily stored in the order of the slices
+      const unsigned slice = frameSlices[frameId];
+      if(sliceInitialized[slice])
+        cerr << "WARNING: More than one frame found for slice " << slice << ", frame " << frameId <<
+        " will overwrite the previous one!" << endl;
+      sliceInitialized[slice] = true;
+
+      // initialize slice with the frame content, both frames and the ITK image
+      //  buffer are stored row by row
+      FloatPixelType *sliceBuffer = pmImage->GetBufferPointer() + slice*frameSize;
+      if(frames) {
+        FloatPixelType *frame = frames->getFrame(frameId);
+        if(!frame) {
+          cerr << "ERROR: Frame " << frameId << " is missing!" << endl;
+          throw -1;
         }
+        memcpy(sliceBuffer, frame, frameSize*sizeof(FloatPixelType));
+      } else if(!frameReader.readFrame(frameId, frameSize*8*sizeof(FloatPixelType),
+                                       OFreinterpret_cast(Uint8*, sliceBuffer))) {
+        cerr << "ERROR: Failed to read frame " << frameId << "!" << endl;
+        throw -1;
       }
     }
 
     return pair <FloatImageType::Pointer, string>(pmImage, metaInfo.getJSONOutputAsString());
   }
 
-  OFCondition ParaMapConverter::addFrame(DPMParametricMapIOD &map, const FloatImageType::Pointer &parametricMapImage,
-                                         const JSONParametricMapMetaInformationHandler &itkNotUsed(metaInfo),
-                                         const unsigned long frameNo, OFVector<FGBase*> groups)
-  {
-    FloatImageType::RegionType sliceRegion;
-    FloatImageType::IndexType sliceIndex;
-    FloatImageType::SizeType inputSize = parametricMapImage->GetBufferedRegion().GetSize();
-
-    sliceIndex[0] = 0;
-    sliceIndex[1] = 0;
-    sliceIndex[2] = frameNo;
-
-    inputSize[2] = 1;
-
-    sliceRegion.SetIndex(sliceIndex);
-    sliceRegion.SetSize(inputSize);
-
-    const unsigned frameSize = inputSize[0] * inputSize[1];
-
-    OFVector<IODFloatingPointImagePixelModule::value_type> data(frameSize);
-
-    itk::ImageRegionConstIteratorWithIndex<FloatImageType> sliceIterator(parametricMapImage, sliceRegion);
-
-    unsigned framePixelCnt = 0;
-    for(sliceIterator.GoToBegin();!sliceIterator.IsAtEnd(); ++sliceIterator, ++framePixelCnt){
-      data[framePixelCnt] = sliceIterator.Get();
-      FloatImageType::IndexType idx = sliceIterator.GetIndex();
-//      cout << framePixelCnt << " " << idx[1] << "," << idx[0] << endl;
-    }
-
-    OFunique_ptr<FGPlanePosPatient> fgPlanePos(new FGPlanePosPatient);
-    OFunique_ptr<FGFrameContent > fgFracon(new FGFrameContent);
-    if (!fgPlanePos  || !fgFracon)
-    {
-      return EC_MemoryExhausted;
-    }
-
-    // Plane Position
-    FloatImageType::PointType sliceOriginPoint;
-    parametricMapImage->TransformIndexToPhysicalPoint(sliceIndex, sliceOriginPoint);
-    fgPlanePos->setImagePositionPatient(
-        Helper::floatToStrScientific(sliceOriginPoint[0]).c_str(),
-        Helper::floatToStrScientific(sliceOriginPoint[1]).c_str(),
-        Helper::floatToStrScientific(sliceOriginPoint[2]).c_str());
-
-    // Frame Content
-    OFCondition result = fgFracon->setDimensionIndexValues(frameNo+1 /* value within dimension */, 0 /* first dimension */);
-
-    // Add frame with related groups
-    if (result.good())
-    {
-      groups.push_back(fgPlanePos.get());
-      groups.push_back(fgFracon.get());
-      groups.push_back(fgPlanePos.get());
-      DPMParametricMapIOD::FramesType frames = map.getFrames();
-      result = OFget<DPMParametricMapIOD::Frames<FloatPixelType> >(&frames)->addFrame(&*data.begin(), frameSize, groups);
-    }
-    return result;
-  }
-
-  void ParaMapConverter::populateMetaInformationFromDICOM(DcmDataset *pmapDataset,
+  void ParaMapConverter::populateMetaInformationFromDICOM(DcmDataset *pmapDataset, DPMParametricMapIOD *pMapDoc,
                                                           JSONParametricMapMetaInformationHandler &metaInfo) {
-
-    OFvariant<OFCondition,DPMParametricMapIOD*> result = DPMParametricMapIOD::loadDataset(*pmapDataset);
-    if (OFCondition* pCondition = OFget<OFCondition>(&result)) {
-      cerr << "ERROR: Failed to load parametric map! " << pCondition->text() << endl;
-      throw -1;
-    }
-    DPMParametricMapIOD* pMapDoc = *OFget<DPMParametricMapIOD*>(&result);
-
     OFString temp;
 
     pMapDoc->getSeries().getSeriesDescription(temp);
@@ -638,8 +554,9 @@ namespace dcmqi {
     pMapDoc->getDPMParametricMapImageModule().getImageType(temp, 3);
     metaInfo.setDerivedPixelContrast(temp.c_str());
 
-    if (pMapDoc->getNumberOfFrames() > 0) {
-      FGInterface& fg = pMapDoc->getFunctionalGroups();
+    // frames may not be loaded, the functional groups have the number of frames
+    FGInterface& fg = pMapDoc->getFunctionalGroups();
+    if (fg.getNumberOfFrames() > 0) {
       FGRealWorldValueMapping* rw = OFstatic_cast(FGRealWorldValueMapping*,
                                                   fg.get(0, DcmFGTypes::EFG_REALWORLDVALUEMAPPING));
       if (rw->getRealWorldValueMapping().size() > 0) {
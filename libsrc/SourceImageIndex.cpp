@@ -0,0 +1,129 @@
+// DCMQI includes
+#include "dcmqi/SourceImageIndex.h"
+
+// DCMTK includes
+#include <dcmtk/dcmdata/dcdeftag.h>
+
+// STD includes
+#include <algorithm>
+#include <cmath>
+#include <iostream>
+
+
+namespace dcmqi {
+
+  SourceImageIndex::SourceImageIndex(const std::vector<DcmDataset*> &datasets) {
+    sortNormal[0] = sortNormal[1] = sortNormal[2] = 0;
+
+    SourceFrame frame;
+    for(size_t datasetId=0;datasetId<datasets.size();datasetId++){
+      DcmDataset *dataset = datasets[datasetId];
+      frame.datasetId = datasetId;
+
+      // enhanced multi-frame instances keep the positions in the functional groups,
+      //  either per frame or shared by all frames
+      if(dataset->tagExists(DCM_PerFrameFunctionalGroupsSequence) ||
+         dataset->tagExists(DCM_SharedFunctionalGroupsSequence)){
+        addFunctionalGroupFrames(dataset, frame);
+      } else if(getPosition(dataset, frame.position)){
+        frame.frameNumber = 0;
+        frames.push_back(frame);
+      }
+    }
+  }
+
+  void SourceImageIndex::findFrames(const double *sliceNormal, double distance, double tolerance,
+                                    std::vector<size_t> &frameIds) {
+    sortFrames(sliceNormal);
+    frameIds.clear();
+    std::vector<SortedFrame>::const_iterator it =
+        std::lower_bound(sortedFrames.begin(), sortedFrames.end(), distance-tolerance);
+    for(;it!=sortedFrames.end() && it->distance<distance+tolerance;++it)
+      frameIds.push_back(it->frameId);
+  }
+
+  std::vector<std::vector<size_t> > SourceImageIndex::getSliceMap(const itk::ImageBase<3> *geometry) {
+    const itk::ImageBase<3>::RegionType region = geometry->GetLargestPossibleRegion();
+    const itk::ImageBase<3>::DirectionType direction = geometry->GetDirection();
+    const double sliceSpacing = geometry->GetSpacing()[2];
+    const double sliceNormal[3] = {direction[0][2], direction[1][2], direction[2][2]};
+
+    std::vector<std::vector<size_t> > slice2frames(region.GetSize()[2]);
+
+    itk::ImageBase<3>::IndexType sliceIndex = region.GetIndex();
+    itk::Point<double, 3> sourcePoint;
+    itk::ImageBase<3>::IndexType sourceIndex;
+    std::vector<size_t> frameIds;
+    size_t framesMapped = 0;
+    for(size_t slice=0;slice<slice2frames.size();slice++){
+      sliceIndex[2] = region.GetIndex()[2]+itk::IndexValueType(slice);
+      itk::Point<double, 3> slicePoint;
+      geometry->TransformIndexToPhysicalPoint(sliceIndex, slicePoint);
+      const double sliceDistance =
+          slicePoint[0]*sliceNormal[0]+slicePoint[1]*sliceNormal[1]+slicePoint[2]*sliceNormal[2];
+
+      // the candidates are confirmed in-plane, same as if every frame was mapped to an index
+      findFrames(sliceNormal, sliceDistance, fabs(sliceSpacing)/2, frameIds);
+      for(size_t i=0;i<frameIds.size();i++){
+        const SourceFrame &frame = frames[frameIds[i]];
+        for(int j=0;j<3;j++)
+          sourcePoint[j] = frame.position[j];
+        if(geometry->TransformPhysicalPointToIndex(sourcePoint, sourceIndex) && sourceIndex[2] == sliceIndex[2]){
+          slice2frames[slice].push_back(frameIds[i]);
+          framesMapped++;
+        }
+      }
+    }
+    if(framesMapped < frames.size())
+      std::cout << frames.size()-framesMapped << " of " << frames.size() <<
+      " source frame(s) do not map to a slice and are not referenced" << std::endl;
+    return slice2frames;
+  }
+
+  void SourceImageIndex::sortFrames(const double *sliceNormal) {
+    // the order does not change for directions that differ by rounding only
+    if(!sortedFrames.empty() && fabs(sliceNormal[0]-sortNormal[0]) < 1e-6 &&
+       fabs(sliceNormal[1]-sortNormal[1]) < 1e-6 && fabs(sliceNormal[2]-sortNormal[2]) < 1e-6)
+      return;
+
+    sortedFrames.resize(frames.size());
+    for(size_t frameId=0;frameId<frames.size();frameId++){
+      const double *position = frames[frameId].position;
+      sortedFrames[frameId].distance =
+          position[0]*sliceNormal[0]+position[1]*sliceNormal[1]+position[2]*sliceNormal[2];
+      sortedFrames[frameId].frameId = frameId;
+    }
+    std::stable_sort(sortedFrames.begin(), sortedFrames.end());
+    for(int j=0;j<3;j++)
+      sortNormal[j] = sliceNormal[j];
+  }
+
+  void SourceImageIndex::addFunctionalGroupFrames(DcmDataset *dataset, SourceFrame &frame) {
+    FGInterface fgInterface;
+    if(fgInterface.read(*dataset).bad()){
+      std::cerr << "WARNING: Failed to read the functional groups of source dataset " << frame.datasetId <<
+      ", its frames are not referenced" << std::endl;
+      return;
+    }
+    const size_t numFrames = fgInterface.getNumberOfFrames();
+    for(size_t frameId=0;frameId<numFrames;frameId++){
+      OFBool isPerFrame;
+      FGPlanePosPatient *planePosition = OFstatic_cast(FGPlanePosPatient*,
+          fgInterface.get(Uint32(frameId), DcmFGTypes::EFG_PLANEPOSPATIENT, isPerFrame));
+      if(!planePosition ||
+         planePosition->getImagePositionPatient(frame.position[0], frame.position[1], frame.position[2]).bad())
+        continue;
+      frame.frameNumber = Uint32(frameId+1);
+      frames.push_back(frame);
+    }
+  }
+
+  bool SourceImageIndex::getPosition(DcmItem *item, double *position) {
+    for(int j=0;j<3;j++){
+      if(!item || item->findAndGetFloat64(DCM_ImagePositionPatient, position[j], j).bad())
+        return false;
+    }
+    return true;
+  }
+
+}
@@ -0,0 +1,87 @@
+// Checks that Helper::floatToDecimalString produces valid DS values that parse back
+//  to the formatted float, and compares its speed with stream based formatting for
+//  the positions of a multi-frame object.
+//
+// Usage: dcmqiDecimalStringBenchmark [numberOfFrames]
+
+// DCMQI includes
+#include "dcmqi/Helper.h"
+
+// DCMTK includes
+#include <dcmtk/ofstd/ofstd.h>
+
+// STD includes
+#include <cstdlib>
+#include <cstring>
+#include <ctime>
+#include <iostream>
+#include <sstream>
+
+using namespace std;
+
+static bool checkValue(float value) {
+  char buffer[dcmqi::Helper::DecimalStringBufferSize];
+  dcmqi::Helper::floatToDecimalString(value, buffer);
+  OFBool success = OFFalse;
+  const double parsed = OFStandard::atof(buffer, &success);
+  if(!success || strlen(buffer) > 16 || float(parsed) != value){
+    cerr << "ERROR: " << value << " formatted as \"" << buffer << "\"" << endl;
+    return false;
+  }
+  return true;
+}
+
+// positions of the slices of a volume tilted in all directions
+static float getPosition(unsigned frame, int j) {
+  return float(-179.6073 + j*31.25 + frame*(0.6134 - j*0.25));
+}
+
+int main(int argc, char *argv[]) {
+  const unsigned numberOfFrames = argc > 1 ? unsigned(atoi(argv[1])) : 10000;
+
+  size_t failed = 0;
+  for(unsigned frame=0;frame<numberOfFrames;frame++){
+    for(int j=0;j<3;j++)
+      failed += !checkValue(getPosition(frame, j));
+  }
+  // sample the whole range of finite values, both signs
+  for(Uint32 bits=0;bits<0x7f800000;bits+=0x1001){
+    float value;
+    memcpy(&value, &bits, sizeof(value));
+    failed += !checkValue(value) + !checkValue(-value);
+  }
+  if(failed){
+    cerr << "ERROR: " << failed << " value(s) were not formatted correctly" << endl;
+    return EXIT_FAILURE;
+  }
+
+  const int repetitions = 10;
+  size_t length = 0;
+
+  clock_t start = clock();
+  for(int r=0;r<repetitions;r++){
+    for(unsigned frame=0;frame<numberOfFrames;frame++){
+      for(int j=0;j<3;j++){
+        ostringstream sstream;
+        sstream << scientific << getPosition(frame, j);
+        length += sstream.str().size();
+      }
+    }
+  }
+  const double streamTime = double(clock()-start)/CLOCKS_PER_SEC/repetitions;
+
+  start = clock();
+  char buffer[dcmqi::Helper::DecimalStringBufferSize];
+  for(int r=0;r<repetitions;r++){
+    for(unsigned frame=0;frame<numberOfFrames;frame++){
+      for(int j=0;j<3;j++)
+        length += strlen(dcmqi::Helper::floatToDecimalString(getPosition(frame, j), buffer));
+    }
+  }
+  const double decimalStringTime = double(clock()-start)/CLOCKS_PER_SEC/repetitions;
+
+  cout << "Formatting ImagePositionPatient of " << numberOfFrames << " frames: stream " <<
+    streamTime*1000 << " ms, floatToDecimalString " << decimalStringTime*1000 << " ms (" <<
+    length << " characters)" << endl;
+  return EXIT_SUCCESS;
+}
@@ -0,0 +1,83 @@
+
+// DCMQI includes
+#include "dcmqi/WorkerPool.h"
+
+// STD includes
+#include <iostream>
+
+
+namespace dcmqi {
+
+  unsigned WorkerPool::getNumberOfThreads(unsigned requestedThreads) {
+    if(requestedThreads)
+      return requestedThreads;
+    return itk::MultiThreader::GetGlobalDefaultNumberOfThreads();
+  }
+
+  unsigned WorkerPool::getNumberOfThreads(int requestedThreads) {
+    if(requestedThreads < 0){
+      std::cerr << "ERROR: Number of threads cannot be negative!" << std::endl;
+      throw -1;
+    }
+    return getNumberOfThreads(unsigned(requestedThreads));
+  }
+
+  bool WorkerPool::run(WorkerTask &task, size_t numberOfItems, unsigned numberOfThreads) {
+    State state;
+    state.task = &task;
+    state.numberOfItems = numberOfItems;
+    state.nextItem = 0;
+    state.failed = false;
+
+    numberOfThreads = getNumberOfThreads(numberOfThreads);
+    if(numberOfThreads > numberOfItems)
+      numberOfThreads = unsigned(numberOfItems);
+
+    if(numberOfThreads <= 1){
+      // nothing to gain from spawning threads
+      for(size_t itemId=0;itemId<numberOfItems && !state.failed;itemId++){
+        try {
+          task.process(itemId);
+        } catch(...) {
+          state.failed = true;
+        }
+      }
+      return !state.failed;
+    }
+
+    itk::MultiThreader::Pointer threader = itk::MultiThreader::New();
+    threader->SetNumberOfThreads(numberOfThreads);
+    threader->SetSingleMethod(threadCallback, &state);
+    threader->SingleMethodExecute();
+
+    return !state.failed;
+  }
+
+  ITK_THREAD_RETURN_TYPE WorkerPool::threadCallback(void *arg) {
+    itk::MultiThreader::ThreadInfoStruct *threadInfo = static_cast<itk::MultiThreader::ThreadInfoStruct*>(arg);
+    State *state = static_cast<State*>(threadInfo->UserData);
+
+    while(true){
+      size_t itemId;
+      state->lock.Lock();
+      if(state->failed || state->nextItem >= state->numberOfItems){
+        state->lock.Unlock();
+        break;
+      }
+      itemId = state->nextItem++;
+      state->lock.Unlock();
+
+      // exceptions must not escape the thread; report them back to run() instead
+      try {
+        state->task->process(itemId);
+      } catch(...) {
+        state->lock.Lock();
+        state->failed = true;
+        state->lock.Unlock();
+      }
+    }
+
+    return ITK_THREAD_RETURN_VALUE;
+  }
+
+}